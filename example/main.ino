@@ -3,6 +3,9 @@
   As long as you can reset your device on-command, and transmit a "BOOT"
   request during the boot countdown, you'll be able to override the firmware
 
+  The countdown is short (BOOT_FALLBACK_MS) unless the application asks
+  for an update before resetting, like below, then it's BOOT_TIMEOUT_MS
+
   This example allows the programmer to also send magic bytes specific to
   a node to allow it to reset on command and be updated.
 **/
@@ -14,6 +17,10 @@
 
 #define MAGIC_BYTES "RESET"
 
+// handoff to the bootloader, must match src/config.h
+#define BOOT_REQUEST_ADDR (RAMEND - 1)
+#define BOOT_REQUEST_MAGIC 0xB007
+
 RH_ASK rf_driver;
 
 void setup() {
@@ -30,7 +37,10 @@ void checkForReset() {
     buf[len] = '\0';
     if (strcmp((char*)buf, MAGIC_BYTES) == 0) {
       // force reset via watchdog
+      // the word at the top of RAM survives it and tells the
+      // bootloader to wait for the update
       cli();
+      *(volatile uint16_t*)BOOT_REQUEST_ADDR = BOOT_REQUEST_MAGIC;
       wdt_enable(WDTO_15MS);
       while(1);
     }
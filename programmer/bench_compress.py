@@ -0,0 +1,60 @@
+'''
+Compression benchmark for the Waveboot transfer format
+
+Reports, for each hex file, how many bytes and frames go over the
+air with plain and compressed pages, and the estimated airtime.
+
+Usage: python bench_compress.py [hex files...] (default: *.hex)
+'''
+
+import glob
+import sys
+
+import image
+import lz
+
+RADIO_SPEED = 2000 # bits per second
+PREAMBLE_LEN = 8 # symbols
+RADIO_MAX_MESSAGE_LEN = 60
+
+def airtime(frames):
+    '''
+    Seconds on air: preamble, then count + 4 headers + message + 2 crc
+    bytes, each byte sent as two 6-bit symbols
+    '''
+    symbols = sum(PREAMBLE_LEN + 2 * (1 + 4 + len(f) + 2) for f in frames)
+    return symbols * 6 / RADIO_SPEED
+
+def check_round_trip(pages):
+    '''
+    Every compressed page must unpack back to the original
+    '''
+    for page, data in pages.items():
+        out = bytearray(b'\xff' * image.PAGE_SIZE)
+        for frame in image.compressed_page_frames(page, data, RADIO_MAX_MESSAGE_LEN):
+            if len(frame) > RADIO_MAX_MESSAGE_LEN:
+                raise AssertionError(f"page 0x{page:04X} has a frame over {RADIO_MAX_MESSAGE_LEN} bytes")
+            offset = ((frame[1] << 8) | frame[2]) - page
+            unpacked = lz.decompress(frame[3:], bytearray(out[:offset]))
+            out[offset:len(unpacked)] = unpacked[offset:]
+        if out != data:
+            raise AssertionError(f"page 0x{page:04X} does not round trip")
+
+def main():
+    files = sys.argv[1:] or sorted(glob.glob("*.hex"))
+    print(f"{'file':<24} {'pages':>5} {'image':>7} {'plain':>7} {'packed':>7} {'ratio':>6} {'frames':>9} {'airtime':>13}")
+    for filename in files:
+        pages = image.read_pages(filename)
+        check_round_trip(pages)
+        payload = sum(len(d.rstrip(b'\xff')) for d in pages.values())
+        plain = image.build_frames(pages, RADIO_MAX_MESSAGE_LEN)
+        packed = image.build_frames(pages, RADIO_MAX_MESSAGE_LEN, compress=True)
+        plain_bytes = sum(map(len, plain))
+        packed_bytes = sum(map(len, packed))
+        frames = f"{len(plain)}/{len(packed)}"
+        seconds = f"{airtime(plain):.1f}s/{airtime(packed):.1f}s"
+        print(f"{filename:<24} {len(pages):>5} {payload:>7} {plain_bytes:>7} {packed_bytes:>7} "
+              f"{packed_bytes / plain_bytes:>6.2f} {frames:>9} {seconds:>13}")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,136 @@
+'''
+FEC benchmark for the Waveboot radio framing
+
+Simulates full-size frames through a binary symmetric channel (and
+optionally short noise bursts) and reports frame success rate and
+effective goodput, with and without RADIO_FEC_LEN parity bytes.
+Mirrors the framing in src/radio.cpp: 4b6b symbols, CRC-CCITT and
+interleaved XOR parity where symbols that fail to decode are erasures.
+
+Usage: python bench_fec.py [--frames N] [--fec LEN] [--burst BITS]
+'''
+
+import argparse
+import random
+
+from image import crc16
+
+RADIO_SPEED = 2000 # bits per second
+PREAMBLE_LEN = 8 # symbols, lost frame if the start symbol is hit
+RADIO_MAX_PAYLOAD_LEN = 67
+RADIO_HEADER_LEN = 4
+
+SYMBOLS = [
+    0x0d, 0x0e, 0x13, 0x15, 0x16, 0x19, 0x1a, 0x1c,
+    0x23, 0x25, 0x26, 0x29, 0x2a, 0x2c, 0x32, 0x34
+]
+DECODE = {s: i for i, s in enumerate(SYMBOLS)}
+
+def encode(message, fec_len):
+    '''
+    count, headers, message, crc, parity as bytes
+    '''
+    count = len(message) + 3 + RADIO_HEADER_LEN + fec_len
+    frame = bytearray([count, 0xFF, 0xFF, 0, 0]) + message
+    crc = ~crc16(frame) & 0xFFFF
+    frame += bytes([crc & 0xFF, crc >> 8])
+    if fec_len:
+        parity = [0] * fec_len
+        for i, b in enumerate(frame):
+            parity[i % fec_len] ^= b
+        for _ in range(fec_len):
+            frame.append(parity[len(frame) % fec_len])
+    return frame
+
+def decode(symbols, fec_len):
+    '''
+    Returns the bytes of a frame from its received 6-bit symbols
+    or None if it can't be recovered
+    '''
+    frame = bytearray()
+    erasures = {}
+    for n in range(0, len(symbols), 2):
+        byte = 0
+        for half, symbol in enumerate(symbols[n:n + 2]):
+            nibble = DECODE.get(symbol)
+            if nibble is None:
+                if not fec_len or n == 0:
+                    return None
+                group = ((n // 2) % fec_len) * 2 + half
+                if group in erasures:
+                    return None
+                erasures[group] = n // 2
+                nibble = 0
+            byte |= nibble << (4 * (1 - half))
+        frame.append(byte)
+
+    for group, erased in erasures.items():
+        value = 0
+        for i in range(erased % fec_len, len(frame), fec_len):
+            value ^= frame[i]
+        frame[erased] |= (value & 0x0F) if group & 1 else (value & 0xF0)
+
+    if crc16(frame[:len(frame) - fec_len]) != 0xF0B8:
+        return None
+    return frame
+
+def transmit(frame, ber, burst):
+    '''
+    Symbols through the channel, bits flip with probability ber
+    and a burst replaces that many consecutive bits with noise
+    returns None if the start symbol was hit (frame never seen)
+    '''
+    start_hit = any(random.random() < ber for _ in range(12))
+    if start_hit:
+        return None
+    total_bits = len(frame) * 12
+    burst_start = random.randrange(total_bits - burst) if burst else total_bits
+    symbols = []
+    for n, b in enumerate(frame):
+        for half, nibble in enumerate((b >> 4, b & 0x0F)):
+            symbol = SYMBOLS[nibble]
+            for bit in range(6):
+                position = n * 12 + half * 6 + bit
+                if burst_start <= position < burst_start + burst:
+                    symbol = (symbol & ~(1 << bit)) | (random.randrange(2) << bit)
+                elif random.random() < ber:
+                    symbol ^= 1 << bit
+            symbols.append(symbol)
+    return symbols
+
+def goodput(ber, fec_len, burst, frames):
+    '''
+    Returns (success rate, message bits per second) for full frames
+    a lost frame costs another full frame of airtime
+    '''
+    message_len = RADIO_MAX_PAYLOAD_LEN - RADIO_HEADER_LEN - 3 - fec_len
+    ok = 0
+    for _ in range(frames):
+        message = bytes(random.randrange(256) for _ in range(message_len))
+        frame = encode(message, fec_len)
+        symbols = transmit(frame, ber, burst)
+        if symbols is not None:
+            received = decode(symbols, fec_len)
+            ok += received is not None and received[5:5 + message_len] == message
+    rate = ok / frames
+    airtime = (PREAMBLE_LEN + 2 * RADIO_MAX_PAYLOAD_LEN) * 6 / RADIO_SPEED
+    return rate, rate * message_len * 8 / airtime
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--frames', type=int, default=2000)
+    parser.add_argument('--fec', type=int, default=4, help="RADIO_FEC_LEN to compare against no FEC")
+    parser.add_argument('--burst', type=int, default=0, help="bits of noise in one burst per frame")
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+    random.seed(args.seed)
+
+    print(f"full frames ({RADIO_MAX_PAYLOAD_LEN} bytes), burst {args.burst} bits")
+    print(f"{'ber':>8}   {'no fec':>18}   {'fec ' + str(args.fec):>18}")
+    for ber in (0, 1e-4, 3e-4, 1e-3, 2e-3, 3e-3, 5e-3, 1e-2):
+        plain = goodput(ber, 0, args.burst, args.frames)
+        fec = goodput(ber, args.fec, args.burst, args.frames)
+        print(f"{ber:>8.0e}   {plain[0]:>6.1%} {plain[1]:>7.0f} bps   {fec[0]:>6.1%} {fec[1]:>7.0f} bps")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,153 @@
+'''
+Serial round trip benchmark for the Waveboot bridge
+
+Pings the bridge with SERIAL_PING frames of a few payload sizes through
+measure_round_trip() in program.py and reports the average round trip
+next to the theoretical time the bytes spend on the wire, the rest is
+USB latency and the bridge's own loop. Then it sends a radio message
+the size of the old 21 byte frames and times it until the bridge
+reports it sent, the airtime included.
+
+With --legacy it times the same send on the original text bridge
+(9600 baud, a hex dump and a delay(10) per frame) instead: 21 bytes
+in, until its "|Command sent" line is out. Run it on both firmwares
+to compare, no node has to be listening, the message is one no
+bootloader acts on.
+
+Usage: python bench_rtt.py [--port PORT] [--count N] [--sizes N,N,...] [--legacy]
+'''
+
+import argparse
+import time
+
+import serial
+
+import program
+
+FRAME_OVERHEAD = 6 # sync, length, type, seq, crc16
+LEGACY_BAUD = 9600
+LEGACY_FRAME_WIDTH = 21 # FIRMWARE_WIDTH of the original bridge
+# not a frame type the bootloader takes, or a reset code
+MESSAGE = b'RTT' + bytes(LEGACY_FRAME_WIDTH - 3)
+
+def wire_time(size, baud):
+    '''
+    Seconds a ping and its pong spend on the wire, 10 bits per byte
+    '''
+    return 2 * (size + FRAME_OVERHEAD) * 10 / baud
+
+def measure_send(ser, count):
+    '''
+    Average seconds from SERIAL_SEND of MESSAGE until SERIAL_SENT,
+    None if the bridge never reported one
+    '''
+    buffer = b''
+    times = []
+    for seq in range(1, count + 1):
+        start = time.time()
+        program.write_frame(ser, program.SERIAL_SEND, bytes([0, 0]) + MESSAGE, seq)
+        deadline = start + 1
+        while time.time() < deadline:
+            frame, buffer = program.read_frame(ser, buffer, deadline - time.time())
+            if frame and frame[0] == program.SERIAL_SENT and frame[1] == seq & 0xFF:
+                times.append(time.time() - start)
+                break
+    if not times:
+        return None
+    return sum(times) / len(times)
+
+def measure_legacy_send(ser, count):
+    '''
+    Average seconds from writing MESSAGE to the original bridge until
+    its "|Command sent" line, None if it never printed one
+    '''
+    times = []
+    for _ in range(count):
+        start = time.time()
+        ser.write(MESSAGE)
+        deadline = start + 2
+        line = b''
+        while time.time() < deadline:
+            line += ser.read(ser.in_waiting or 1)
+            if b'|Command sent' in line:
+                times.append(time.time() - start)
+                break
+        # the rest of the line, and whatever the radio picked up
+        time.sleep(0.05)
+        ser.reset_input_buffer()
+    if not times:
+        return None
+    return sum(times) / len(times)
+
+def legacy(port, count):
+    ser = serial.Serial(port, LEGACY_BAUD, timeout=0.1)
+    # opening the port restarts the bridge, it says when it's up
+    deadline = time.time() + 5
+    banner = b''
+    while time.time() < deadline and b'|Bridge ready' not in banner:
+        banner += ser.read(ser.in_waiting or 1)
+    if b'|Bridge ready' not in banner:
+        print(f"Original bridge on {port} not responding")
+        ser.close()
+        return
+    time.sleep(0.1)
+    ser.reset_input_buffer()
+
+    send = measure_legacy_send(ser, count)
+    print(f"original bridge on {port}, {LEGACY_BAUD} baud, {count} sends")
+    if send is None:
+        print(f"{LEGACY_FRAME_WIDTH} byte send: no answer")
+    else:
+        print(f"{LEGACY_FRAME_WIDTH} byte send: {send * 1000:.1f}ms (measured, airtime included)")
+    ser.close()
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--port', help="serial port of the bridge, the first one found by default")
+    parser.add_argument('--count', type=int, default=20, help="pings per size, as many as fit in 3s, and sends")
+    parser.add_argument('--sizes', default="0,16,32,48", help="ping payload sizes in bytes")
+    parser.add_argument('--legacy', action='store_true', help="the bridge runs the original text firmware")
+    args = parser.parse_args()
+
+    port = args.port
+    if not port:
+        ports = program.find_serial_ports()
+        if not ports:
+            print("No serial ports found!")
+            return
+        port = ports[0]
+
+    if args.legacy:
+        legacy(port, args.count)
+        return
+
+    ser = serial.Serial(port, program.SERIAL_BAUD, timeout=1)
+
+    # opening the port restarts the bridge, the first round waits it out
+    if program.measure_round_trip(ser, count=1) is None:
+        print(f"Bridge on {port} not responding")
+        ser.close()
+        return
+
+    print(f"bridge on {port}, {program.SERIAL_BAUD} baud, {args.count} pings per size")
+    print("round trip is measured, wire is the theoretical time on the serial line")
+    print(f"{'bytes':>6}   {'round trip':>10}   {'wire':>8}   {'the rest':>8}")
+    for size in (int(s) for s in args.sizes.split(",")):
+        round_trip = program.measure_round_trip(ser, count=args.count, size=size)
+        wire = wire_time(size, program.SERIAL_BAUD)
+        if round_trip is None:
+            print(f"{size:>6}   {'no answer':>10}")
+            continue
+        print(f"{size:>6}   {round_trip * 1000:>8.2f}ms   {wire * 1000:>6.2f}ms   "
+              f"{(round_trip - wire) * 1000:>6.2f}ms")
+
+    send = measure_send(ser, args.count)
+    if send is None:
+        print(f"{LEGACY_FRAME_WIDTH} byte send: no answer")
+    else:
+        print(f"{LEGACY_FRAME_WIDTH} byte send: {send * 1000:.1f}ms (measured, airtime included)")
+
+    ser.close()
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,273 @@
+'''
+Firmware image helpers for the Waveboot CLI tool
+
+Turns an Intel Hex file into flash pages and the binary
+frames the bootloader expects:
+
+<type><address high><address low><data...>
+
+Pages that are all 0xFF aren't sent as data, runs of them go out
+as one erase frame instead:
+
+<type><first page><page count>
+'''
+
+import struct
+import zlib
+
+import lz
+
+PAGE_SIZE = 128 # SPM_PAGESIZE on the atmega328p
+BOOT_START = 0x7000 # first address of the bootloader section
+
+# frame types, must match program.h
+FRAME_DATA = 0x00
+FRAME_END = 0x01
+FRAME_QUERY = 0x02
+FRAME_ZDATA = 0x03
+FRAME_BEGIN = 0x04
+FRAME_ERASE = 0x05
+FRAME_POLL = 0x06
+FRAME_DATA_HEADER_LEN = 3
+
+# the bootloader erases a range before it reads the next frame,
+# 32 pages are ~145ms, the two receive slots hold what arrives meanwhile
+ERASE_MAX_PAGES = 32
+
+BLANK_PAGE = b'\xff' * PAGE_SIZE
+
+def crc16(data, crc=0xFFFF):
+    '''
+    CRC-CCITT as computed by Radio::updateCRC, used for page digests
+    '''
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+    return crc
+
+def query_frame(first_page, count):
+    '''
+    Ask for the digests of count pages starting at page index first_page
+    '''
+    return bytes([FRAME_QUERY, first_page, count])
+
+def poll_frame():
+    '''
+    Ask a node of a fleet update which pages it's still missing
+    '''
+    return bytes([FRAME_POLL])
+
+def missing_pages(bitmap):
+    '''
+    Page addresses a node reported missing, bit i is page index i
+    '''
+    return {i * PAGE_SIZE for i in range(len(bitmap) * 8)
+            if bitmap[i // 8] & (1 << (i % 8))}
+
+def is_blank(data):
+    '''
+    True for a page that reads as erased
+    '''
+    return data == BLANK_PAGE
+
+def sparse_pages(pages):
+    '''
+    Only the pages that hold something, all 0xFF ones (padding)
+    are what an erase leaves behind
+    '''
+    return {page: data for page, data in pages.items() if not is_blank(data)}
+
+def fill_gaps(pages):
+    '''
+    Every page from 0 to the last one of the image, missing ones erased
+    this is what flash holds after the update, and what the manifest covers
+    '''
+    if not pages:
+        return {}
+    return {page: pages.get(page, bytearray(BLANK_PAGE))
+            for page in range(0, max(pages) + PAGE_SIZE, PAGE_SIZE)}
+
+def erase_tail(pages):
+    '''
+    Add erased pages from the end of the image up to the bootloader,
+    so nothing is left of a larger image that was there before
+    the bootloader skips the ones that are erased already
+    anything the application keeps past its code goes too
+    '''
+    last = max(pages) if pages else -PAGE_SIZE
+    tail = {page: bytearray(BLANK_PAGE)
+            for page in range(last + PAGE_SIZE, BOOT_START, PAGE_SIZE)}
+    return {**pages, **tail}
+
+def manifest(pages, version=0):
+    '''
+    <length low><length high><crc32, little endian><version low><version high>
+    of an image without gaps (fill_gaps), the low 16 bits of the CRC
+    are the image id the bootloader keeps its resume point under
+    '''
+    data = b''.join(bytes(pages[page]) for page in sorted(pages))
+    return struct.pack('<HIH', len(data), zlib.crc32(data), version)
+
+def image_id(manifest):
+    '''
+    Id the bootloader reports its resume point under
+    '''
+    return manifest[2] | (manifest[3] << 8)
+
+def begin_frame(manifest):
+    '''
+    First frame of an update, describes the image
+    '''
+    return bytes([FRAME_BEGIN]) + manifest
+
+def pages_from(pages, first_page):
+    '''
+    Pages at or past page index first_page, what's left after a resume
+    '''
+    return {page: data for page, data in pages.items()
+            if page // PAGE_SIZE >= first_page}
+
+def changed_pages(pages, digests):
+    '''
+    Pages whose contents differ from the digests reported by the node
+    digests maps page index to CRC, pages without a digest are kept
+    '''
+    return {page: data for page, data in pages.items()
+            if digests.get(page // PAGE_SIZE) != crc16(data)}
+
+def parse_hex_line(line):
+    '''
+    Parse one Intel Hex record
+    returns (record_type, address, data) or None if the line is invalid
+    '''
+    if not line.startswith(':'):
+        return None
+    try:
+        raw = bytes.fromhex(line[1:])
+    except ValueError:
+        return None
+    if len(raw) < 5 or len(raw) != raw[0] + 5:
+        return None
+    # two's complement checksum over every byte sums to 0
+    if sum(raw) & 0xFF:
+        return None
+    return raw[3], (raw[1] << 8) | raw[2], raw[4:-1]
+
+def read_pages(filename):
+    '''
+    Read a hex file into {page address: bytearray(PAGE_SIZE)}
+    records that share a page are merged, no matter their order in the file,
+    unused bytes stay 0xFF (erased flash)
+    '''
+    pages = {}
+    base = 0
+    with open(filename, 'r') as f:
+        for n, line in enumerate(f, 1):
+            line = line.strip()
+            if not line:
+                continue
+            record = parse_hex_line(line)
+            if record is None:
+                raise ValueError(f"invalid record on line {n}")
+            record_type, address, data = record
+
+            if record_type == 0x00:
+                for i, b in enumerate(data):
+                    addr = base + address + i
+                    page = addr & ~(PAGE_SIZE - 1)
+                    if page not in pages:
+                        pages[page] = bytearray(b'\xff' * PAGE_SIZE)
+                    pages[page][addr - page] = b
+            elif record_type == 0x01:
+                break
+            elif record_type == 0x02:
+                # extended segment address
+                base = ((data[0] << 8) | data[1]) << 4
+            elif record_type == 0x04:
+                # extended linear address
+                base = ((data[0] << 8) | data[1]) << 16
+            # 0x03/0x05 start addresses mean nothing to the bootloader
+
+    for page in pages:
+        if page >= BOOT_START:
+            raise ValueError(f"page 0x{page:04X} overlaps the bootloader")
+    return pages
+
+def erase_frames(first, count):
+    '''
+    Erase count pages starting at page address first, as few frames
+    as ERASE_MAX_PAGES allows
+    '''
+    frames = []
+    page = first // PAGE_SIZE
+    while count:
+        n = min(count, ERASE_MAX_PAGES)
+        frames.append(bytes([FRAME_ERASE, page, n]))
+        page += n
+        count -= n
+    return frames
+
+def page_frames(page, data, max_message_len):
+    '''
+    Split one page into as few frames as fit in a radio message
+    trailing 0xFF is not sent, the bootloader pre-fills pages with it
+    '''
+    end = len(data.rstrip(b'\xff'))
+    chunk = max_message_len - FRAME_DATA_HEADER_LEN
+    frames = []
+    offset = 0
+    while True:
+        addr = page + offset
+        piece = bytes(data[offset:min(offset + chunk, end)])
+        frames.append(bytes([FRAME_DATA, addr >> 8, addr & 0xFF]) + piece)
+        offset += chunk
+        if offset >= end:
+            return frames
+
+def compressed_page_frames(page, data, max_message_len):
+    '''
+    Same as page_frames() but with the page lz compressed
+    tokens are never split, each frame starts at the output offset
+    of its first token
+    '''
+    chunk = max_message_len - FRAME_DATA_HEADER_LEN
+    frames = []
+    addr = page
+    stream = b''
+    out = 0
+    for token, length in lz.compress(bytes(data.rstrip(b'\xff')), chunk):
+        if stream and len(stream) + len(token) > chunk:
+            frames.append(bytes([FRAME_ZDATA, addr >> 8, addr & 0xFF]) + stream)
+            addr = page + out
+            stream = b''
+        stream += token
+        out += length
+    frames.append(bytes([FRAME_ZDATA, addr >> 8, addr & 0xFF]) + stream)
+    return frames
+
+def build_frames(pages, max_message_len, compress=False):
+    '''
+    Frames for a whole image, pages in ascending order, then the end frame
+    with compress, each page goes out compressed when that is smaller
+    consecutive blank pages go out as erase frames
+    '''
+    frames = []
+    blank = [] # run of consecutive blank pages
+    for page in sorted(pages):
+        if blank and (not is_blank(pages[page]) or blank[-1] + PAGE_SIZE != page):
+            frames += erase_frames(blank[0], len(blank))
+            blank = []
+        if is_blank(pages[page]):
+            blank.append(page)
+            continue
+        raw = page_frames(page, pages[page], max_message_len)
+        if compress:
+            packed = compressed_page_frames(page, pages[page], max_message_len)
+            if sum(map(len, packed)) < sum(map(len, raw)):
+                raw = packed
+        frames += raw
+    if blank:
+        frames += erase_frames(blank[0], len(blank))
+    frames.append(bytes([FRAME_END]))
+    return frames
@@ -0,0 +1,81 @@
+'''
+Small-window LZ codec for Waveboot firmware pages
+
+Every page is compressed on its own so the bootloader can unpack
+straight into its page buffer, back references never leave the page.
+
+token < 0x80: literal run, (token + 1) bytes follow
+token >= 0x80: match, copy (token & 0x7F) + MIN_MATCH bytes from
+               (next byte + 1) bytes back in the page, may overlap
+
+Must match src/lz.cpp
+'''
+
+MIN_MATCH = 3
+MAX_MATCH = 0x7F + MIN_MATCH
+MAX_LITERALS = 0x80
+MAX_DISTANCE = 0x100
+
+def longest_match(data, pos):
+    '''
+    Longest earlier copy of data[pos:], returns (length, distance)
+    '''
+    best_len, best_dist = 0, 0
+    for start in range(max(0, pos - MAX_DISTANCE), pos):
+        length = 0
+        # overlapping copies are allowed, they repeat short patterns
+        while (pos + length < len(data) and length < MAX_MATCH
+               and data[start + length] == data[pos + length]):
+            length += 1
+        if length >= best_len:
+            best_len, best_dist = length, pos - start
+    return best_len, best_dist
+
+def compress(data, max_token_len=MAX_LITERALS + 1):
+    '''
+    Greedy compression, returns a list of (token bytes, output length)
+    so callers can split the stream between tokens
+    literal runs are cut so no token is longer than max_token_len
+    '''
+    max_literals = min(MAX_LITERALS, max_token_len - 1)
+    tokens = []
+    literals = bytearray()
+
+    def flush():
+        if literals:
+            tokens.append((bytes([len(literals) - 1]) + bytes(literals), len(literals)))
+            literals.clear()
+
+    pos = 0
+    while pos < len(data):
+        length, distance = longest_match(data, pos)
+        if length >= MIN_MATCH:
+            flush()
+            tokens.append((bytes([0x80 | (length - MIN_MATCH), distance - 1]), length))
+            pos += length
+        else:
+            literals.append(data[pos])
+            pos += 1
+            if len(literals) == max_literals:
+                flush()
+    flush()
+    return tokens
+
+def decompress(stream, out=None):
+    '''
+    Reference decoder, mirrors lz_unpack() in the bootloader
+    '''
+    out = bytearray() if out is None else out
+    i = 0
+    while i < len(stream):
+        token = stream[i]
+        i += 1
+        if token & 0x80:
+            distance = stream[i] + 1
+            i += 1
+            for _ in range((token & 0x7F) + MIN_MATCH):
+                out.append(out[-distance])
+        else:
+            out += stream[i:i + token + 1]
+            i += token + 1
+    return out
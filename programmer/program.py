@@ -10,11 +10,89 @@ import serial.tools.list_ports
 import time
 import glob
 
+import image
+
 # can be increased or decreased depending on the radio
 # 6 seems sorta overkill but doesn't hurt
 # but increase if a lot of requests are being dropped
 REQUEST_ATTEMPTS = 6
 
+# seconds between BOOT requests while waiting for RDY, well short
+# of BOOT_QUIET_MS in src/config.h, after a reset the application
+# didn't ask for the bootloader stops listening once the channel is
+# quiet for that long, a late write on a busy host shouldn't do it
+BOOT_INTERVAL = 0.1
+
+# number of frames sent before waiting for an ACK
+# the bootloader holds at most 8, set to 1 for stop-and-wait
+WINDOW_SIZE = 8
+
+# radio header flags, must match program.h
+# FLAG_ACK_REQUEST asks the bootloader to ACK after this frame
+FLAG_ACK_REQUEST = 0x01
+FLAG_MULTICAST = 0x02
+FLAG_PAGE_END = 0x04
+# FRAME_POLL reply status bits
+POLL_HAS_MANIFEST = 0x01
+POLL_UP_TO_DATE = 0x02
+
+# fleet updates: BOOT is broadcast this many times, BOOT_INTERVAL apart
+# every node answers RDY at once, so nobody is asked for it
+FLEET_BOOT_REPEATS = 8
+# rounds of polling every node and broadcasting what they're missing
+FLEET_REPAIR_ROUNDS = 10
+# a node gives up after PROGRAMMING_TIMEOUT_MS (src/config.h) without
+# a frame, polling a big fleet takes longer, so broadcast in between
+FLEET_KEEPALIVE = 3
+
+# ask the bootloader for a digest of every page first and
+# only send the pages that changed
+DELTA_UPDATES = True
+
+# continue an update that was cut short from the page the bootloader
+# reports in RDY, if it was the same image
+RESUME_UPDATES = True
+
+# erase whatever is past the end of the image, up to the bootloader,
+# so an image that shrank doesn't leave old code behind
+# off by default, that flash is the application's to keep data in
+# and this would wipe it on every update, delta ones too
+ERASE_TAIL = False
+
+# send pages lz compressed when that is smaller (see lz.py)
+COMPRESSION = True
+
+# print the bridge's log frames
+VERBOSE = False
+
+# hand the frames to the bridge and let it run the window, acks and
+# retries on its own, instead of deciding every retry over serial
+AUTONOMOUS = True
+
+# the bridge retries a window SEND_ATTEMPTS times with a 400ms ack
+# timeout, if nothing is reported for this long it's gone
+AUTONOMOUS_TIMEOUT = 15
+
+# binary framing with the bridge, must match programmer/src/main.cpp
+# <sync><len><type><seq><payload><crc16 low><crc16 high>
+SERIAL_BAUD = 115200
+SERIAL_SYNC = 0x7E
+SERIAL_SEND = 0x01
+SERIAL_PING = 0x02
+SERIAL_VERBOSE = 0x03
+SERIAL_QUEUE = 0x04
+SERIAL_QUEUE_RESET = 0x05
+SERIAL_SEND_TO = 0x06
+SERIAL_SENT = 0x81
+SERIAL_RECV = 0x82
+SERIAL_PONG = 0x83
+SERIAL_LOG = 0x84
+SERIAL_DONE = 0x85
+SERIAL_FAILED = 0x86
+SERIAL_CREDIT = 0x87
+
+serial_seq = 0
+
 def find_serial_ports():
     return [port.device for port in serial.tools.list_ports.comports()]
 
@@ -30,14 +108,39 @@ def connect():
     
     try:
         choice = int(input("Select port: ")) - 1
-        # I wonder if we can increase baud rate, but 9600 should be fine for now
-        ser = serial.Serial(ports[choice], 9600, timeout=1)
+        ser = serial.Serial(ports[choice], SERIAL_BAUD, timeout=1)
         print(f"Connected to {ports[choice]}")
-        return ser
     except:
         print("Connection failed")
         return None
 
+    # opening the port restarts the bridge, pinging also waits it out
+    round_trip = measure_round_trip(ser)
+    if round_trip is None:
+        print("Bridge not responding")
+        ser.close()
+        return None
+    print(f"Bridge round trip: {round_trip * 1000:.1f}ms")
+    if VERBOSE:
+        write_frame(ser, SERIAL_VERBOSE, b'\x01')
+    return ser
+
+def get_version():
+    version = input("Enter image version (press Enter for 0): ").strip()
+    try:
+        return int(version, 0) & 0xFFFF if version else 0
+    except ValueError:
+        print("Not a number, using 0")
+        return 0
+
+def get_fleet():
+    addresses = input("Enter node addresses for a fleet update, comma separated (press Enter for one node): ").strip()
+    try:
+        return [int(a, 0) for a in addresses.split(',')] if addresses else []
+    except ValueError:
+        print("Not a list of addresses, updating one node")
+        return []
+
 def get_reset_code():
     reset_code = input("Enter reset code (press Enter for default 'RESET'): ").strip()
     if not reset_code:
@@ -66,33 +169,6 @@ def select_hex_file():
     except:
         return None
 
-def hex_to_binary(hex_line):
-    ''''
-    Convert's Intel Hex to binary reperesentation
-    
-    <record_type><address high><address low><data_len><data><checksum>
-    ^ 21 bytes
-    '''
-    
-    if hex_line.startswith(':'):
-        hex_line = hex_line[1:]
-    try:
-        hex_bytes = bytes.fromhex(hex_line)
-        binary_data = bytearray(21)
-        copy_len = min(len(hex_bytes), 21)
-        binary_data[:copy_len] = hex_bytes[:copy_len]
-        return bytes(binary_data)
-    except:
-        return None
-
-def read_hex_file(filename):
-    try:
-        with open(filename, 'r') as f:
-            # one-liner... this is what python is all about
-            return [line.strip() for line in f if line.strip().startswith(':')]
-    except:
-        return None
-
 def create_radio_loading_bar(current, total, attempt, max_attempts, elapsed_time):
     """Create a radio-themed loading display"""
     # radio static effect
@@ -108,110 +184,583 @@ def create_radio_loading_bar(current, total, attempt, max_attempts, elapsed_time
     bar = '█' * filled_width + '░' * (bar_width - filled_width)
     
     print(f"\n[{bar}] {progress*100:5.1f}%")
-    print(f"Line: {current:4d}/{total:<4d}  |  Attempt: {attempt}/{max_attempts}  |  Time: {elapsed_time:6.1f}s")
+    print(f"Frame: {current:4d}/{total:<4d}  |  Attempt: {attempt}/{max_attempts}  |  Time: {elapsed_time:6.1f}s")
     print("\033[3A", end="")
 
-def program(ser, hex_filename, reset_code="RESET"):
-    hex_lines = read_hex_file(hex_filename)
-    if not hex_lines:
-        print("Failed to read hex file")
+def write_frame(ser, frame_type, payload=b'', seq=0):
+    '''
+    Send one frame to the bridge
+    <sync><len><type><seq><payload><crc16 low><crc16 high>
+    '''
+    body = bytes([len(payload), frame_type, seq & 0xFF]) + payload
+    crc = image.crc16(body)
+    ser.write(bytes([SERIAL_SYNC]) + body + bytes([crc & 0xFF, crc >> 8]))
+
+def read_frame(ser, buffer, timeout):
+    '''
+    Read one frame from the bridge, returns ((type, seq, payload), buffer)
+    the frame is None if nothing complete arrived before the timeout
+    log frames are printed when VERBOSE and never returned
+    '''
+    deadline = time.time() + timeout
+    while True:
+        # anything before a sync byte is noise (or a bridge restart)
+        start = buffer.find(bytes([SERIAL_SYNC]))
+        buffer = buffer[start:] if start >= 0 else b''
+
+        if len(buffer) >= 2 and len(buffer) >= buffer[1] + 6:
+            end = buffer[1] + 4
+            body = buffer[1:end]
+            if image.crc16(body) != buffer[end] | (buffer[end + 1] << 8):
+                # not a real sync byte, look for the next one
+                buffer = buffer[1:]
+                continue
+            buffer = buffer[end + 2:]
+            frame_type, seq, payload = body[1], body[2], bytes(body[3:])
+            if frame_type == SERIAL_LOG:
+                if VERBOSE:
+                    print(f"|{payload.decode('utf-8', errors='ignore')}")
+                continue
+            return (frame_type, seq, payload), buffer
+
+        if time.time() >= deadline:
+            return None, buffer
+        if ser.in_waiting:
+            buffer += ser.read(ser.in_waiting)
+
+def send_command(ser, payload, frame_id=0, flags=0, to=None):
+    '''
+    Hand a message to the bridge for the radio, with the radio
+    header id and flags it should be sent with
+    every node takes it, unless it's sent to one node's address
+    '''
+    global serial_seq
+    serial_seq = (serial_seq + 1) & 0xFF
+    header = bytes([frame_id & 0xFF, flags])
+    if to is None:
+        write_frame(ser, SERIAL_SEND, header + payload, serial_seq)
+    else:
+        write_frame(ser, SERIAL_SEND_TO, bytes([to]) + header + payload, serial_seq)
+
+def parse_response(frame):
+    '''
+    Bridge forwards node responses as <id><flags><address><message>,
+    the message starts with a 3 letter tag
+    returns (tag, [bytes]) or None for anything else
+    '''
+    if not frame or frame[0] != SERIAL_RECV or len(frame[2]) < 6:
+        return None
+    payload = frame[2]
+    return payload[3:6].decode('ascii', errors='ignore'), list(payload[6:])
+
+def response_address(frame):
+    '''
+    Address of the node a response came from
+    '''
+    return frame[2][2]
+
+def measure_round_trip(ser, count=20, size=32):
+    '''
+    Ping the bridge with frame sized payloads, returns the average
+    round trip in seconds or None if it never answered
+    '''
+    buffer = b''
+    times = []
+    deadline = time.time() + 3
+    seq = 0
+    while len(times) < count and time.time() < deadline:
+        seq = (seq + 1) & 0xFF
+        start = time.time()
+        write_frame(ser, SERIAL_PING, bytes(size), seq)
+        frame, buffer = read_frame(ser, buffer, 0.2)
+        if frame and frame[0] == SERIAL_PONG and frame[1] == seq:
+            times.append(time.time() - start)
+    if not times:
+        return None
+    return sum(times) / len(times)
+
+def send_window(ser, frames, base, end, acked, buffer):
+    '''
+    Send every unacked frame in the window starting at base,
+    up to end, the last one asks for an ACK. Returns the buffer.
+    '''
+    burst = [i for i in range(base, min(base + WINDOW_SIZE, end)) if i not in acked]
+    for n, i in enumerate(burst):
+        flags = FLAG_ACK_REQUEST if n == len(burst) - 1 else 0
+        send_command(ser, frames[i], i, flags)
+        # the bridge buffers a single command, wait for it to go out
+        # before handing it the next one
+        while True:
+            frame, buffer = read_frame(ser, buffer, 1)
+            if frame is None or frame[0] == SERIAL_SENT:
+                break
+    return buffer
+
+def stream_frames(ser, frames, buffer, start_time, first=0):
+    '''
+    Queue frames on the bridge as fast as it has room (credits)
+    it sends, waits for acks and retries on its own, and reports
+    each frame once the bootloader has it
+    the first one goes out with radio id first
+    pages that didn't read back as written are only reported, the
+    bootloader holds the end frame until they're sent again
+    returns (frames delivered, buffer), None if the bridge gave up
+    '''
+    write_frame(ser, SERIAL_QUEUE_RESET)
+    credits = 0
+    deadline = time.time() + 1
+    while time.time() < deadline:
+        frame, buffer = read_frame(ser, buffer, deadline - time.time())
+        if frame and frame[0] == SERIAL_CREDIT and frame[2]:
+            credits = frame[2][0]
+            break
+    if not credits:
+        print("Bridge has no queue, update its firmware")
+        return None, buffer
+
+    sent = 0
+    done = 0
+    while done < len(frames):
+        while credits and sent < len(frames):
+            write_frame(ser, SERIAL_QUEUE, bytes([(first + sent) & 0xFF]) + frames[sent])
+            sent += 1
+            credits -= 1
+
+        create_radio_loading_bar(done, len(frames), 1, 1, time.time() - start_time)
+
+        frame, buffer = read_frame(ser, buffer, AUTONOMOUS_TIMEOUT)
+        if frame is None:
+            print(f"\n\n\nBridge stopped responding at frame {done + 1}")
+            return None, buffer
+        if frame[0] == SERIAL_DONE:
+            done += 1
+            credits += 1
+        elif frame[0] == SERIAL_FAILED:
+            # the page is sent again from the window, which
+            # the bootloader reports it in as well
+            if len(frame[2]) >= 2:
+                print(f"\n\n\nPage {frame[2][1]} didn't read back as written, it's sent again at the end")
+                continue
+            print(f"\n\n\nFailed at frame {done + 1}")
+            return None, buffer
+
+    return done, buffer
+
+def run_window(ser, frames, base, end, buffer, start_time, repair=None):
+    '''
+    Send frames[base:end] a window at a time, resending whatever
+    the bootloader reports missing, frames are numbered by their index
+    repair(page index) gives the frames of a page that didn't read back
+    as written, they're sent again right before the end frame, which
+    has to be frames[end - 1], the update stops without it or if the
+    page fails again
+    returns (tag, buffer), "ACK" once everything up to end is acked,
+    "DNE", "UTD" or "BAD" if the bootloader finished the update,
+    None if it stopped answering or a page can't be repaired
+    '''
+    # the bootloader acks with the next index it expects plus a
+    # bitmap of the frames it already holds past that
+    acked = set()
+    attempt = 0
+    # pages sent again, with the index of their first frame, once the
+    # bootloader is past it a page that's still failed is a bad page
+    repaired = {}
+
+    while base < end:
+        elapsed = time.time() - start_time
+        
+        # Show the radio-themed loading display
+        create_radio_loading_bar(base, len(frames), attempt + 1, REQUEST_ATTEMPTS, elapsed)
+
+        buffer = send_window(ser, frames, base, end, acked, buffer)
+
+        # Wait for ACK
+        progress = False
+        ack_timeout = time.time() + 1
+        while time.time() < ack_timeout:
+            frame, buffer = read_frame(ser, buffer, ack_timeout - time.time())
+            response = parse_response(frame)
+            if not response:
+                continue
+
+            tag, args = response
+            # python 3.10 has a nicer way to do this
+            # with match, but I'd rather keep it compatible
+            if tag == "ACK" and len(args) >= 2:
+                # ids are 8 bits, unwrap relative to the window base
+                next_index = base + ((args[0] - base) & 0xFF)
+                if next_index > end:
+                    continue
+                for i in range(base, next_index):
+                    acked.discard(i)
+                for bit in range(8):
+                    if args[1] & (1 << bit):
+                        acked.add(next_index + bit)
+                progress = next_index > base
+                base = next_index
+                # pages that didn't read back as written, a bit per page
+                # like the fleet's missing pages, none from older bootloaders
+                failed = [i * 8 + bit for i, bits in enumerate(args[2:])
+                          for bit in range(8) if bits & (1 << bit)]
+                for page in failed:
+                    if page in repaired:
+                        if next_index > repaired[page]:
+                            print(f"\n\n\nPage {page} failed again, the image would fail verification")
+                            return None, buffer
+                        continue
+                    frames_for_page = repair(page) if repair else None
+                    if not frames_for_page or end != len(frames) or frames[-1] != bytes([image.FRAME_END]):
+                        print(f"\n\n\nPage {page} didn't read back as written, the image would fail verification")
+                        return None, buffer
+                    print(f"\n\n\nPage {page} didn't read back as written, sending it again")
+                    repaired[page] = end - 1
+                    frames[end - 1:end - 1] = frames_for_page
+                    end += len(frames_for_page)
+                    # an end frame the bootloader holds is refused while
+                    # the page is failed, its id now belongs to the page
+                    acked = {i for i in acked if i < repaired[page]}
+                break
+            elif tag in ("DNE", "UTD", "BAD"):
+                return tag, buffer
+
+        if progress:
+            attempt = 0
+        else:
+            attempt += 1
+            if attempt >= REQUEST_ATTEMPTS:
+                print(f"\n\n\nFailed at frame {base + 1}")
+                return None, buffer
+
+    return "ACK", buffer
+
+def query_digests(ser, pages, max_message_len, buffer):
+    '''
+    Ask the bootloader for the CRC of every page between the first
+    and last page of the image, returns ({page index: crc}, buffer)
+    '''
+    digests = {}
+    per_reply = (max_message_len - 4) // 2
+    first = min(pages) // image.PAGE_SIZE
+    last = max(pages) // image.PAGE_SIZE
+
+    while first <= last:
+        count = min(per_reply, last - first + 1)
+        for attempt in range(REQUEST_ATTEMPTS):
+            send_command(ser, image.query_frame(first, count))
+            response = None
+            deadline = time.time() + 1
+            while time.time() < deadline:
+                frame, buffer = read_frame(ser, buffer, deadline - time.time())
+                response = parse_response(frame)
+                if response and response[0] == "CRC" and response[1] and response[1][0] == first:
+                    break
+                response = None
+            if response:
+                break
+        if not response:
+            return None, buffer
+
+        data = response[1][1:]
+        for i in range(len(data) // 2):
+            digests[first + i] = data[2 * i] | (data[2 * i + 1] << 8)
+        first += count
+
+    return digests, buffer
+
+def program(ser, hex_filename, reset_code="RESET", version=0):
+    try:
+        pages = image.read_pages(hex_filename)
+    except (OSError, ValueError) as e:
+        print(f"Failed to read hex file: {e}")
         return False
     
+    # what flash should hold afterwards, the bootloader checks it
+    # against the manifest before it boots the image
+    # padding counts as a gap, gaps go out as erase frames
+    pages = image.fill_gaps(image.sparse_pages(pages))
+    manifest = image.manifest(pages, version)
+    if ERASE_TAIL:
+        pages = image.erase_tail(pages)
+    full_pages = pages
+    image_id = image.image_id(manifest)
     print(f"Programming with {hex_filename}")
     print(f"Using reset code: '{reset_code}'")
     start_time = time.time()
     
-    '''
-        All commands are bound to 21 bytes since
-        each firmware line is 21 bytes long.
-        To keep things consistent, we send the
-        RESET and BOOT commands as 21-byte binary
-        and pad the rest of the lines with 0x00
-    '''
-    # Send custom reset code, padded to 21 bytes
-    reset_bytes = reset_code.encode('utf-8')[:21]  # Truncate if longer than 21 bytes
-    reset_command = reset_bytes + b'\x00' * (21 - len(reset_bytes))
-    
-    ser.write(reset_command)
-    time.sleep(1)  # wait for bootloader to reset
-    ser.write(b'BOOT' + b'\x00' * 17)
+    send_command(ser, reset_code.encode('utf-8'))
     
     # wait for RDY
     print("Waiting for bootloader...")
     ready = False
     timeout = time.time() + 10
-    buffer = ""
+    next_boot = time.time()
+    buffer = b''
     
+    # RDY carries the largest message the bootloader accepts,
+    # where an update that was cut short left off and the
+    # version of the image it has
+    max_message_len = 60
+    resume_page = 0
     while time.time() < timeout and not ready:
-        # not sure if this is the best way to do this
-        if ser.in_waiting:
-            data = ser.read(ser.in_waiting).decode('utf-8', errors='ignore')
-            buffer += data
-            while '\n' in buffer:
-                line, buffer = buffer.split('\n', 1)
-                if "RDY" in line:
-                    ready = True
-                    break
-        # time.sleep(0.1)
+        # after a reset without the application's handoff the
+        # bootloader only listens for a moment, so keep asking
+        if time.time() >= next_boot:
+            send_command(ser, b'BOOT')
+            next_boot = time.time() + BOOT_INTERVAL
+        frame, buffer = read_frame(ser, buffer, min(next_boot, timeout) - time.time())
+        response = parse_response(frame)
+        if response and response[0] == "RDY":
+            args = response[1]
+            if args:
+                max_message_len = args[0]
+            # older bootloaders don't report a resume point
+            if len(args) >= 4 and (args[1] | (args[2] << 8)) == image_id:
+                resume_page = args[3]
+            if len(args) >= 6 and (args[4] | (args[5] << 8)) != 0xFFFF:
+                print(f"Bootloader has version {args[4] | (args[5] << 8)}")
+            ready = True
     
     if not ready:
         print("Bootloader not ready!")
         return False
+
+    # the manifest goes first and on its own, a bootloader that
+    # already has the image answers it with UTD instead of an ACK
+    # it also lets the bootloader keep track of how far this
+    # image got, in case the update is cut short
+    frames = [image.begin_frame(manifest)]
+    tag, buffer = run_window(ser, frames, 0, 1, buffer, start_time)
+    if tag == "UTD":
+        print(f"\n\n\nAlready up to date (version {version})\n")
+        return True
+    if tag != "ACK":
+        return False
     
-    print(f"Programming {len(hex_lines)} lines...")
+    if RESUME_UPDATES and resume_page:
+        total = len(pages)
+        pages = image.pages_from(pages, resume_page)
+        print(f"Resuming at page {resume_page}, {total - len(pages)}/{total} pages already written")
+
+    # blank pages are cheap, the bootloader skips them if they're erased
+    if DELTA_UPDATES and image.sparse_pages(pages):
+        print("Comparing against flash...")
+        digests, buffer = query_digests(ser, image.sparse_pages(pages), max_message_len, buffer)
+        if digests is None:
+            print("No digests received, sending the whole image")
+        else:
+            total = len(pages)
+            pages = image.changed_pages(pages, digests)
+            print(f"{total - len(pages)}/{total} pages already up to date")
+
+    frames += image.build_frames(pages, max_message_len, COMPRESSION)
+
+    written = len(image.sparse_pages(pages))
+    print(f"Programming {written} pages, erasing {len(pages) - written}, in {len(frames)} frames...")
     
-    # Send hex lines
-    for i, hex_line in enumerate(hex_lines, 1):
-        binary_data = hex_to_binary(hex_line)
-        if not binary_data:
-            print(f"Failed to parse line {i}")
+    base = 1
+
+    # a page that didn't read back as written, from the image as it
+    # is, the bootloader may not have been sent all of it
+    def repair(page):
+        address = page * image.PAGE_SIZE
+        if address not in full_pages:
+            return None
+        return image.build_frames({address: full_pages[address]}, max_message_len, COMPRESSION)[:-1]
+
+    if AUTONOMOUS:
+        # everything up to the end frame, that one is answered
+        # with DNE instead of an ACK so it goes through the loop below,
+        # which also sends the pages that failed again
+        delivered, buffer = stream_frames(ser, frames[base:-1], buffer, start_time, base)
+        if delivered is None:
             return False
-        
-        success = False
+        base += delivered
+
+    tag, buffer = run_window(ser, frames, base, len(frames), buffer, start_time, repair)
+    elapsed = time.time() - start_time
+    if tag == "DNE":
+        print(f"\n\n\nProgramming finished in {elapsed:.1f}s\n")
+        return True
+    if tag == "BAD":
+        print("\n\n\nImage failed verification on the node, try again\n")
+    return False
+
+def multicast_headers(frames):
+    '''
+    (radio id, flags) to broadcast frames to a fleet with, the id is
+    the frame's place in its page and the last one of a page is marked
+    '''
+    pages = [(f[1] << 8 | f[2]) & ~(image.PAGE_SIZE - 1)
+             if f[0] in (image.FRAME_DATA, image.FRAME_ZDATA) else None
+             for f in frames]
+    headers = []
+    part = 0
+    for i, page in enumerate(pages):
+        part = part + 1 if i and page is not None and pages[i - 1] == page else 0
+        last = i + 1 == len(pages) or page is None or pages[i + 1] != page
+        headers.append((part, FLAG_MULTICAST | (FLAG_PAGE_END if last else 0)))
+    return headers
+
+def broadcast(ser, frames, buffer, start_time, round_number):
+    '''
+    Send frames to every node once, nothing is acked
+    returns the buffer
+    '''
+    for i, (message, (part, flags)) in enumerate(zip(frames, multicast_headers(frames))):
+        create_radio_loading_bar(i, len(frames), round_number, FLEET_REPAIR_ROUNDS, time.time() - start_time)
+        send_command(ser, message, part, flags)
+        # the bridge buffers a single command
+        while True:
+            frame, buffer = read_frame(ser, buffer, 1)
+            if frame is None or frame[0] == SERIAL_SENT:
+                break
+    return buffer
+
+def wait_for(ser, address, tags, buffer):
+    '''
+    Wait for a response with one of tags from the node at address
+    returns ((tag, [bytes]), buffer) or (None, buffer) after a second
+    '''
+    deadline = time.time() + 1
+    while time.time() < deadline:
+        frame, buffer = read_frame(ser, buffer, deadline - time.time())
+        response = parse_response(frame)
+        if response and response[0] in tags and response_address(frame) == address:
+            return response, buffer
+    return None, buffer
+
+def poll_node(ser, address, buffer):
+    '''
+    Ask one node of a fleet update where it is
+    returns ((status, {missing page addresses}), buffer), None if it
+    never answered
+    '''
+    for attempt in range(REQUEST_ATTEMPTS):
+        send_command(ser, image.poll_frame(), to=address)
+        response, buffer = wait_for(ser, address, ("NAK",), buffer)
+        if response and response[1]:
+            args = response[1]
+            return (args[0], image.missing_pages(args[1:])), buffer
+    return None, buffer
+
+def keep_alive(ser, due):
+    '''
+    Broadcast a poll nobody answers once due has passed, so the nodes
+    that aren't being talked to don't time out
+    returns when the next one is due
+    '''
+    if time.time() < due:
+        return due
+    send_command(ser, image.poll_frame())
+    return time.time() + FLEET_KEEPALIVE
+
+def poll_fleet(ser, addresses, buffer):
+    '''
+    Poll every node, returns ({address: (status, missing)}, buffer),
+    without the nodes that didn't answer
+    '''
+    states = {}
+    due = time.time() + FLEET_KEEPALIVE
+    for address in addresses:
+        due = keep_alive(ser, due)
+        state, buffer = poll_node(ser, address, buffer)
+        if state is not None:
+            states[address] = state
+    return states, buffer
+
+def program_fleet(ser, hex_filename, addresses, reset_code="RESET", version=0):
+    '''
+    Update every node at addresses with the same image, broadcast once
+    and repaired with whatever pages any node reports missing, instead
+    of one update after the other (see FLAG_MULTICAST in program.h)
+    nodes are told apart by the address in their EEPROM (NODE_ADDRESS_ADDR)
+    '''
+    try:
+        pages = image.read_pages(hex_filename)
+    except (OSError, ValueError) as e:
+        print(f"Failed to read hex file: {e}")
+        return False
+
+    # the same image as program(), delta and resume are per node,
+    # a node skips pages it already has on its own
+    pages = image.fill_gaps(image.sparse_pages(pages))
+    manifest = image.manifest(pages, version)
+    if ERASE_TAIL:
+        pages = image.erase_tail(pages)
+    # every node runs the same bootloader, so no RDY is needed to know
+    # how big a frame can be
+    max_message_len = 60
+    begin = image.begin_frame(manifest)
+    frames = image.build_frames(pages, max_message_len, COMPRESSION)[:-1]
+
+    print(f"Programming {len(addresses)} nodes with {hex_filename}")
+    start_time = time.time()
+
+    # the application of every node hears it
+    send_command(ser, reset_code.encode('utf-8'))
+    print("Waiting for bootloaders...")
+    buffer = b''
+    for _ in range(FLEET_BOOT_REPEATS):
+        send_command(ser, b'BOOT')
+        _, buffer = read_frame(ser, buffer, BOOT_INTERVAL)
+
+    states, buffer = poll_fleet(ser, addresses, buffer)
+    for address in addresses:
+        if address not in states:
+            print(f"Node {address} not in the bootloader, skipped")
+    if not states:
+        return False
+    reached = list(states)
+
+    print(f"Broadcasting {len(pages)} pages in {len(frames) + 1} frames...")
+    buffer = broadcast(ser, [begin] + frames, buffer, start_time, 1)
+
+    # the last round is only polled, to know who has everything
+    for round_number in range(2, FLEET_REPAIR_ROUNDS + 2):
+        states, buffer = poll_fleet(ser, list(states), buffer)
+        need_begin = any(not status & POLL_HAS_MANIFEST for status, _ in states.values())
+        missing = set()
+        for status, node_missing in states.values():
+            if not status & POLL_UP_TO_DATE:
+                missing |= node_missing & set(pages)
+        if (not missing and not need_begin) or round_number > FLEET_REPAIR_ROUNDS:
+            break
+        repair = image.build_frames({page: pages[page] for page in missing}, max_message_len, COMPRESSION)[:-1]
+        print(f"\n\n\nRepairing {len(missing)} pages for {len(states)} nodes")
+        buffer = broadcast(ser, ([begin] if need_begin else []) + repair, buffer, start_time, round_number)
+
+    # one at a time, each answers like at the end of a normal update
+    # a node without the manifest or with pages missing isn't asked,
+    # it would fail verification, or boot an image it can't check
+    results = {address: None for address in reached}
+    due = time.time() + FLEET_KEEPALIVE
+    for address, (status, node_missing) in states.items():
+        due = keep_alive(ser, due)
+        if not status & POLL_UP_TO_DATE and (not status & POLL_HAS_MANIFEST or node_missing & set(pages)):
+            results[address] = "INCOMPLETE"
+            continue
+        tag = None
         for attempt in range(REQUEST_ATTEMPTS):
-            elapsed = time.time() - start_time
-            
-            # Show the radio-themed loading display
-            create_radio_loading_bar(i, len(hex_lines), attempt + 1, REQUEST_ATTEMPTS, elapsed)
-            
-            ser.write(binary_data)
-            
-            # TODO: this code is sorta messy, abstract it seperate functions
-            # Wait for ACK
-            ack_timeout = time.time() + 1
-            while time.time() < ack_timeout:
-                if ser.in_waiting:
-                    data = ser.read(ser.in_waiting).decode('utf-8', errors='ignore')
-                    buffer += data
-                    while '\n' in buffer:
-                        line, buffer = buffer.split('\n', 1)
-                        # python 3.10 has a nicer way to do this
-                        # with match, but I'd rather keep it compatible
-                        if "PRG" in line:
-                            success = True
-                            break
-                        elif "DNE" in line:
-                            elapsed = time.time() - start_time
-                            print(f"\n\n\nProgramming finished in {elapsed:.1f}s\n")
-                            return True
-                        elif "CHK" in line or "ERR" in line:
-                            break
-                    if success:
-                        break
-                # time.sleep(0.1)
-            
-            if success:
+            send_command(ser, bytes([image.FRAME_END]), 0, FLAG_MULTICAST, to=address)
+            response, buffer = wait_for(ser, address, ("DNE", "UTD", "BAD"), buffer)
+            if response:
+                tag = response[0]
                 break
-        
-            # time.sleep(1)
-        
-        if not success:
-            print(f"Failed at line {i}")
-            return False
-    
+        # every answer to FRAME_END was lost, the node stays a moment
+        # after its last one (FINISHED_LINGER_MS), ask it where it is
+        if tag is None:
+            state, buffer = poll_node(ser, address, buffer)
+            if state is not None and state[0] & POLL_UP_TO_DATE:
+                tag = "DNE"
+        results[address] = tag
+
     elapsed = time.time() - start_time
-    print(f"All lines sent! {elapsed:.1f}s")
-    return True
+    print(f"\n\n\nFleet update finished in {elapsed:.1f}s")
+    names = {"DNE": "updated", "UTD": "already up to date", "BAD": "failed verification",
+             "INCOMPLETE": "still missing pages, not finished", None: "stopped answering"}
+    for address in addresses:
+        print(f"Node {address}: {names[results[address]] if address in results else 'not in the bootloader'}")
+    return all(results.get(address) in ("DNE", "UTD") for address in addresses)
 
 def main():
     print(r" _       __                 __                __ ");
@@ -230,7 +779,12 @@ def main():
 
     hex_file = select_hex_file()
     if hex_file:
-        program(ser, hex_file, reset_code)
+        version = get_version()
+        fleet = get_fleet()
+        if fleet:
+            program_fleet(ser, hex_file, fleet, reset_code, version)
+        else:
+            program(ser, hex_file, reset_code, version)
     
     ser.close()
 
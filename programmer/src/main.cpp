@@ -1,85 +1,343 @@
 #include <Arduino.h>
 #include <SPI.h>
+#include <stdio.h>
 #include "radio.h" // this is the RadioHead library rewritten (just use RadioHead should also work)
 
-#define FIRMWARE_WIDTH 21
+// binary framing between the cli and the bridge, both directions
+// <SERIAL_SYNC><len><type><seq><len bytes><crc16 low><crc16 high>
+// the crc is CRC-CCITT (init 0xFFFF) over len, type, seq and payload
+// a frame with a bad crc is dropped, the cli retries like a lost radio frame
+#define SERIAL_BAUD 115200
+#define SERIAL_SYNC 0x7E
+#define SERIAL_MAX_PAYLOAD (RADIO_MAX_MESSAGE_LEN + 3)
+#define SERIAL_TIMEOUT_MS 20 // a frame stalled this long is dropped
+
+// cli -> bridge
+#define SERIAL_SEND 0x01 // <radio id><radio flags><message>, answered with SERIAL_SENT
+#define SERIAL_PING 0x02 // answered with SERIAL_PONG, same seq and payload
+#define SERIAL_VERBOSE 0x03 // <0 or 1>, per message SERIAL_LOG frames
+#define SERIAL_QUEUE 0x04 // <radio id><message>, uses one credit
+#define SERIAL_QUEUE_RESET 0x05 // <>, empties the queue, answered with SERIAL_CREDIT
+#define SERIAL_SEND_TO 0x06 // <node address><radio id><radio flags><message>, like SERIAL_SEND
+// bridge -> cli
+#define SERIAL_SENT 0x81 // <>, the SERIAL_SEND with this seq is done transmitting
+#define SERIAL_RECV 0x82 // <radio id><radio flags><node address><message> from the node
+#define SERIAL_PONG 0x83
+#define SERIAL_LOG 0x84 // text
+#define SERIAL_DONE 0x85 // <radio id>, acked by the node, returns one credit
+#define SERIAL_FAILED 0x86 // <radio id>, out of attempts, the queue was emptied
+                          // <radio id><page>, a page didn't read back as written,
+                          // the queue goes on, the cli sends it again before the end
+#define SERIAL_CREDIT 0x87 // <credits>, how many SERIAL_QUEUE frames fit
+
+// queued frames are sent with the same sliding window as the cli
+// uses (see program.h), the bridge waits for the ACK and resends
+// what's missing itself, the cli only hears DONE or FAILED
+#define QUEUE_LEN 10 // a window plus room for the cli to refill ahead
+#define WINDOW_SIZE 8 // must match program.h
+#define FLAG_ACK_REQUEST 0x01
+#define ACK_TIMEOUT_MS 400 // after the last frame of a burst is out
+#define SEND_ATTEMPTS 6 // bursts without progress before giving up
+#define BURST_IDLE_MS 5 // start a short burst once the cli stops queueing
+#define FAILED_BITMAP_LEN 28 // POLL_BITMAP_LEN in program.h, a bit per application page
 
 // RADIO BRIDGE PROGRAMMER
 // forwards commands from cli tool to remote node via radio
-
-/**
- * | - on device logs
- * > - outbound messages
- * < - inbound messages
- */
+// a pipe, everything the node says goes back to the cli as is
 
 Radio driver;
 
+// frame from the cli being collected, everything after the sync byte
+static uint8_t command[3 + SERIAL_MAX_PAYLOAD + 2];
+static uint8_t command_pos;
+static bool command_synced = false;
+static uint32_t command_started;
+static bool verbose = false;
+
+struct QueuedFrame {
+  uint8_t id;
+  uint8_t len;
+  bool acked; // held by the node past a missing frame
+  uint8_t data[RADIO_MAX_MESSAGE_LEN];
+};
+
+// queue[queue_head] is the oldest frame the node hasn't confirmed
+static QueuedFrame queue[QUEUE_LEN];
+static uint8_t queue_head = 0;
+static uint8_t queue_count = 0;
+static uint32_t last_queued;
+// burst in progress, position in the window of the next frame to send
+static uint8_t burst_pos;
+static bool bursting = false;
+static bool waiting_ack = false;
+static uint32_t burst_done;
+static uint8_t attempts = 0;
+// failed pages in the last ACK, only new ones are reported
+static uint8_t failed_pages[FAILED_BITMAP_LEN];
+
+static void write_frame(uint8_t type, uint8_t seq, const uint8_t* payload, uint8_t len) {
+  uint8_t header[4] = { SERIAL_SYNC, len, type, seq };
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 1; i < sizeof(header); i++) crc = Radio::updateCRC(crc, header[i]);
+  for (uint8_t i = 0; i < len; i++) crc = Radio::updateCRC(crc, payload[i]);
+
+  Serial.write(header, sizeof(header));
+  Serial.write(payload, len);
+  Serial.write(crc & 0xFF);
+  Serial.write(crc >> 8);
+}
+
+static void log_line(const char* text) {
+  write_frame(SERIAL_LOG, 0, (const uint8_t*)text, strlen(text));
+}
+
+// collect a frame from the cli without blocking
+// true once a complete frame with a good crc is in command
+static bool poll_serial() {
+  if (command_synced && millis() - command_started > SERIAL_TIMEOUT_MS) {
+    command_synced = false;
+  }
+
+  while (Serial.available()) {
+    uint8_t c = Serial.read();
+
+    if (!command_synced) {
+      if (c == SERIAL_SYNC) {
+        command_synced = true;
+        command_pos = 0;
+        command_started = millis();
+      }
+      continue;
+    }
+
+    if (command_pos == 0 && c > SERIAL_MAX_PAYLOAD) {
+      command_synced = false;
+      continue;
+    }
+
+    command[command_pos++] = c;
+    // len, type, seq, payload, crc
+    if (command_pos < command[0] + 5) continue;
+
+    command_synced = false;
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < command_pos - 2; i++) crc = Radio::updateCRC(crc, command[i]);
+    if (command[command_pos - 2] == (crc & 0xFF) && command[command_pos - 1] == (crc >> 8)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static QueuedFrame* queued(uint8_t i) {
+  return &queue[(queue_head + i) % QUEUE_LEN];
+}
+
+static uint8_t window_len() {
+  return queue_count < WINDOW_SIZE ? queue_count : WINDOW_SIZE;
+}
+
+static void queue_reset() {
+  queue_head = 0;
+  queue_count = 0;
+  bursting = false;
+  waiting_ack = false;
+  attempts = 0;
+}
+
+// next frame of the burst that the node doesn't hold yet
+static bool next_unacked(uint8_t* pos) {
+  for (; *pos < window_len(); (*pos)++) {
+    if (!queued(*pos)->acked) return true;
+  }
+  return false;
+}
+
+// send the window one frame per call, without blocking on the radio
+static void run_queue() {
+  if (waiting_ack) {
+    if (millis() - burst_done < ACK_TIMEOUT_MS) return;
+    // nothing came back, send the window again
+    waiting_ack = false;
+    if (++attempts >= SEND_ATTEMPTS) {
+      write_frame(SERIAL_FAILED, 0, &queued(0)->id, 1);
+      queue_reset();
+      return;
+    }
+  }
+
+  if (driver.sending()) return;
+
+  if (!bursting) {
+    if (queue_count == 0) return;
+    // let the cli fill the window first
+    if (queue_count < WINDOW_SIZE && millis() - last_queued < BURST_IDLE_MS) return;
+    bursting = true;
+    burst_pos = 0;
+  }
+
+  if (!next_unacked(&burst_pos)) {
+    // last one is out, the node answers the ACK request
+    bursting = false;
+    waiting_ack = true;
+    burst_done = millis();
+    return;
+  }
+
+  QueuedFrame* frame = queued(burst_pos++);
+  uint8_t pos = burst_pos;
+  driver.setHeaderId(frame->id);
+  driver.setHeaderFlags(next_unacked(&pos) ? 0 : FLAG_ACK_REQUEST);
+  driver.send(frame->data, frame->len);
+}
+
+// <'A'><'C'><'K'><next expected id><bitmap of held frames past it>
+// <bitmap of failed pages, cut after the last byte with a bit set>
+static void handle_ack(const uint8_t* message, uint8_t len) {
+  if (len < 5 || queue_count == 0) return;
+
+  uint8_t done = message[3] - queued(0)->id; // wraps like the ids
+  if (done > queue_count) return; // stale
+
+  // an ACK that moves nothing is as good as a lost burst, a node that
+  // keeps rejecting the same frame must not hold the queue forever
+  if (done == 0 && ++attempts >= SEND_ATTEMPTS) {
+    write_frame(SERIAL_FAILED, 0, &queued(0)->id, 1);
+    queue_reset();
+    return;
+  }
+  if (done > 0) attempts = 0;
+
+  for (; done != 0; done--) {
+    write_frame(SERIAL_DONE, 0, &queued(0)->id, 1);
+    queue_head = (queue_head + 1) % QUEUE_LEN;
+    queue_count--;
+  }
+
+  // a failed page stays in every ACK until it's sent again, which is
+  // up to the cli, the node holds the end frame until then
+  for (uint8_t i = 0; i < FAILED_BITMAP_LEN; i++) {
+    uint8_t bits = 5 + i < len ? message[5 + i] : 0;
+    uint8_t fresh = bits & ~failed_pages[i];
+    failed_pages[i] = bits;
+    for (uint8_t bit = 0; fresh != 0; bit++, fresh >>= 1) {
+      if (!(fresh & 1)) continue;
+      uint8_t failed[2] = { message[3], (uint8_t)(i * 8 + bit) };
+      write_frame(SERIAL_FAILED, 0, failed, sizeof(failed));
+    }
+  }
+
+  for (uint8_t i = 0; i < window_len(); i++) {
+    queued(i)->acked = (message[4] >> i) & 1;
+  }
+
+  waiting_ack = false;
+}
+
+static void handle_command() {
+  uint8_t len = command[0];
+  uint8_t type = command[1];
+  uint8_t seq = command[2];
+  uint8_t* payload = &command[3];
+
+  switch (type) {
+    case SERIAL_SEND:
+    case SERIAL_SEND_TO: {
+      // everything else goes to every node
+      uint8_t to = DEFAULT_ADDRESS;
+      if (type == SERIAL_SEND_TO) {
+        if (len < 1) break;
+        to = payload[0];
+        payload++;
+        len--;
+      }
+      if (len < 2) break;
+      digitalWrite(LED_BUILTIN, HIGH);
+      driver.setHeaderTo(to);
+      driver.setHeaderId(payload[0]);
+      driver.setHeaderFlags(payload[1]);
+      driver.send(payload + 2, len - 2);
+      driver.wait_packet_send();
+      driver.setHeaderTo(DEFAULT_ADDRESS);
+      digitalWrite(LED_BUILTIN, LOW);
+      // the cli waits for this before handing over the next one
+      write_frame(SERIAL_SENT, seq, NULL, 0);
+      if (verbose) log_line("Command sent, waiting for response...");
+      break;
+    }
+    case SERIAL_PING:
+      write_frame(SERIAL_PONG, seq, payload, len);
+      break;
+    case SERIAL_VERBOSE:
+      verbose = len && payload[0];
+      break;
+    case SERIAL_QUEUE: {
+      // the cli never has more credits than free slots
+      if (len < 1 || queue_count == QUEUE_LEN) break;
+      QueuedFrame* frame = queued(queue_count++);
+      frame->id = payload[0];
+      frame->len = len - 1;
+      frame->acked = false;
+      memcpy(frame->data, payload + 1, len - 1);
+      last_queued = millis();
+      break;
+    }
+    case SERIAL_QUEUE_RESET: {
+      queue_reset();
+      // a new update, none of its pages have failed yet
+      memset(failed_pages, 0, sizeof(failed_pages));
+      uint8_t credits = QUEUE_LEN;
+      write_frame(SERIAL_CREDIT, seq, &credits, 1);
+      break;
+    }
+  }
+}
+
 void setup() {
-  Serial.begin(9600);
+  Serial.begin(SERIAL_BAUD);
   pinMode(LED_BUILTIN, OUTPUT);
-  
-  Serial.println("|System starting up...");
-  
+
   if (!driver.init()) {
-    Serial.println("|Radio init failed!");
+    log_line("Radio init failed!");
     // implement a way to reset programmer
     while(1); // halt on radio failure
-  } else {
-    Serial.println("|Radio initialized successfully");
   }
-  
-  Serial.println("|Bridge ready - waiting for commands from Python script");
+
+  log_line("Bridge ready");
 }
 
 void loop() {
-  if (Serial.available()) {
-    uint8_t buf[FIRMWARE_WIDTH];
-    Serial.readBytes(buf, FIRMWARE_WIDTH);
-    
-    Serial.print(">Sending: ");
-    // print buf as HEX string
-    for (int i = 0; i < FIRMWARE_WIDTH; i++) {
-      if (i < FIRMWARE_WIDTH - 1) Serial.print("0x");
-      Serial.print(buf[i], HEX);
-      if (i < FIRMWARE_WIDTH - 1) Serial.print(" ");
+  if (poll_serial()) handle_command();
+  run_queue();
+
+  const uint8_t* message;
+  uint8_t message_len;
+
+  if (driver.recv_view(&message, &message_len)) {
+    // acks for queued frames are handled here, the cli only hears DONE
+    if (waiting_ack && message_len >= 3 && strncmp((const char*)message, "ACK", 3) == 0) {
+      handle_ack(message, message_len);
+      driver.release();
+      return;
     }
-    Serial.println();
-    
-    digitalWrite(LED_BUILTIN, HIGH);
-    driver.send((uint8_t*)buf, FIRMWARE_WIDTH); 
-    driver.wait_packet_send();
-    digitalWrite(LED_BUILTIN, LOW);
-    
-    Serial.println("|Command sent, waiting for response...");
-  }
-  
-  // 64 should be fine
-  uint8_t buf[64];
-  uint8_t buflen = sizeof(buf) - 1;
-  
-  if (driver.recv(buf, &buflen)) {
-    buf[buflen] = '\0';
-    
-    // forward response back to cli
-    Serial.print("<Received (");
-    Serial.print(buflen);
-    Serial.print(" bytes): ");
-    Serial.println((char *)buf);
-    
-    // sorta messy, I don't like using strncmp so much
-    if (strncmp((char*)buf, "RDY", 3) == 0) {
-      Serial.println("|Bootloader is ready!");
-    } else if (strncmp((char*)buf, "PRG", 3) == 0) {
-      Serial.println("|Progress acknowledged");
-    } else if (strncmp((char*)buf, "DNE", 3) == 0) {
-      Serial.println("|Programming completed!");
-    } else if (strncmp((char*)buf, "CHK", 3) == 0) {
-      Serial.println("|Checksum error reported from remote node");
-    } else if (strncmp((char*)buf, "ERR", 3) == 0) {
-      Serial.println("|Error reported from remote node");
+
+    // forward response back to cli with the headers it came with
+    uint8_t response[3 + RADIO_MAX_MESSAGE_LEN];
+    response[0] = driver.headerId();
+    response[1] = driver.headerFlags();
+    response[2] = driver.headerFrom();
+    memcpy(response + 3, message, message_len);
+    driver.release();
+
+    write_frame(SERIAL_RECV, 0, response, 3 + message_len);
+
+#if RADIO_PROFILE
+    if (verbose) {
+      char line[40];
+      snprintf(line, sizeof(line), "Worst radio ISR (timer1 ticks): %u", Radio::isrTicksMax());
+      log_line(line);
     }
+#endif
   }
-  
-  delay(10); // Small delay to prevent overwhelming the serial interface
-}
\ No newline at end of file
+}
@@ -12,12 +12,34 @@
 
 #include <stdint.h>
 
+// count + headers + message + crc, must match on both ends of the link
+// can be raised with -DRADIO_MAX_PAYLOAD_LEN=... to fit a whole page
+// in fewer frames, at the cost of 3 bytes of RAM per byte
+#ifndef RADIO_MAX_PAYLOAD_LEN
 #define RADIO_MAX_PAYLOAD_LEN 67
+#endif
 #define RADIO_HEADER_LEN 4
-#define RADIO_MAX_MESSAGE_LEN (RADIO_MAX_PAYLOAD_LEN - RADIO_HEADER_LEN - 3)
+
+// forward error correction, parity bytes appended to every frame
+// byte j is the XOR of every byte at a position i with
+// i % RADIO_FEC_LEN == j, so one bad symbol per group can be rebuilt
+// (any burst of up to 2 * RADIO_FEC_LEN symbols), 0 disables it
+// must match on both ends of the link
+#ifndef RADIO_FEC_LEN
+#define RADIO_FEC_LEN 0
+#endif
+#define RADIO_NO_ERASURE 0xFF
+#define RADIO_INVALID_SYMBOL 0xFF
+
+#define RADIO_MAX_MESSAGE_LEN (RADIO_MAX_PAYLOAD_LEN - RADIO_HEADER_LEN - 3 - RADIO_FEC_LEN)
 #define RADIO_START_SYMBOL 0xB38
 #define PREAMBLE_LEN 8
-#define MAX_PAYLOAD_LEN 67
+#define MAX_PAYLOAD_LEN RADIO_MAX_PAYLOAD_LEN
+
+// tx index and length are 8 bit, 2 symbols per byte + preamble
+#if (MAX_PAYLOAD_LEN * 2) + PREAMBLE_LEN > 255
+#error "RADIO_MAX_PAYLOAD_LEN is limited to 123"
+#endif
 #define RADIO_SPEED 2000
 #define DEFAULT_ADDRESS 0xFF // wild card address
 
@@ -31,6 +53,64 @@
 #define RADIO_RAMP_INC_RETARD (RADIO_RAMP_INC - RADIO_RAMP_ADJUST)
 #define RADIO_RAMP_INC_ADVANCE (RADIO_RAMP_INC + RADIO_RAMP_ADJUST)
 
+// receive engine
+// 0: software PLL sampling RADIO_RX_PIN RADIO_RX_SAMPLES_PER_BIT times
+//    per bit from the timer1 compare interrupt, whenever in Rx
+// 1: input capture, timer1 timestamps edges on ICP1 (PB0, the receiver
+//    must be wired there) and bits are recovered from pulse widths,
+//    interrupts follow the edge rate instead of the sample rate
+#ifndef RADIO_RX_CAPTURE
+#define RADIO_RX_CAPTURE 0
+#endif
+
+#if RADIO_RX_CAPTURE
+#define RADIO_CAPTURE_DDR DDRB
+#define RADIO_CAPTURE_PIN PINB
+#define RADIO_CAPTURE_BIT PB0
+#define RADIO_CAPTURE_TICKS_PER_BIT (F_CPU / 8 / RADIO_SPEED) // prescaler 8
+#define RADIO_CAPTURE_FLUSH_BITS 8 // a quiet line is shifted in after this long
+#endif
+
+// CRC engine
+// 0: shift/xor per byte, ~22 cycles (same algorithm as avr-libc's
+//    _crc_ccitt_update)
+// 1: two lookups in a 16 entry PROGMEM nibble table, ~45 cycles on AVR
+//    because of the two 16 bit shifts by 4, smaller win on cores with
+//    a barrel shifter
+#ifndef RADIO_CRC_TABLE
+#define RADIO_CRC_TABLE 0
+#endif
+
+// 1 keeps the worst case timer1 ticks spent in any radio interrupt,
+// counted from the event that triggered it, readable with isrTicksMax()
+// (timer1 runs at F_CPU / 8 with RADIO_RX_CAPTURE, else F_CPU at 2000bps)
+#ifndef RADIO_PROFILE
+#define RADIO_PROFILE 0
+#endif
+
+// carrier sense, this many clean bits in a row (runs with
+// RADIO_RX_CAPTURE) count as a transmitter on the air, receiver
+// noise rarely lines up with the bit clock for long
+#define RADIO_SENSE_LEN 16
+
+// frames the ISR can hold before the application takes them,
+// each slot costs MAX_PAYLOAD_LEN + 3 bytes of RAM (+ FEC bookkeeping)
+// with 1 the receiver ignores traffic until the frame is released
+#ifndef RADIO_RX_SLOTS
+#define RADIO_RX_SLOTS 2
+#endif
+
+struct RadioSlot {
+    uint8_t len;
+    uint16_t crc; // accumulated as bytes are decoded
+    uint8_t buffer[MAX_PAYLOAD_LEN];
+#if RADIO_FEC_LEN
+    uint8_t erasures[RADIO_FEC_LEN * 2]; // byte of the bad symbol per group
+    bool erasure_lost;
+    bool erased; // crc saw a 0 in place of a lost nibble
+#endif
+};
+
 enum RadioMode {
     Idle,
     Tx,
@@ -41,7 +121,6 @@ class Radio {
     private:
         volatile RadioMode mode; // volatile because it can be changed in ISR
         uint8_t address;
-        void setAddress(uint8_t address);
         // tx
         uint8_t tx_header_to;
         uint8_t tx_header_from;
@@ -49,10 +128,19 @@ class Radio {
         uint8_t tx_header_flags;
         uint8_t tx_index;
         uint8_t tx_bit;
-        uint8_t tx_sample;
         uint8_t tx_buffer_len;
         uint8_t tx_buffer[(MAX_PAYLOAD_LEN * 2) + PREAMBLE_LEN];
+#if RADIO_FEC_LEN
+        uint8_t tx_parity[RADIO_FEC_LEN];
+#endif
+        uint8_t encode(uint8_t index, uint8_t data);
         void transmit_timer();
+#if !RADIO_RX_CAPTURE
+        // timer1 compare value for one rx sample, tx runs
+        // RADIO_RX_SAMPLES_PER_BIT times slower (once per bit)
+        uint16_t sample_ticks;
+        void set_timer_ticks(uint16_t ticks);
+#endif
         // rx
         volatile uint8_t rx_header_to;
         volatile uint8_t rx_header_from;
@@ -64,29 +152,77 @@ class Radio {
         volatile uint16_t rx_bits;
         volatile uint8_t rx_bit_count;
         volatile uint8_t rx_pll_ramp;
-        volatile bool rx_buffer_full;
-        volatile bool rx_buffer_valid;
+        volatile uint8_t rx_sense_count;
+        volatile bool rx_carrier; // sticky until carrier()
+        volatile bool rx_buffer_valid; // the oldest slot passed validation
         volatile uint8_t rx_count;
+        // ring of received frames, the ISR fills rx_head while the
+        // application reads from rx_tail
+        RadioSlot rx_slots[RADIO_RX_SLOTS];
+        RadioSlot* rx_slot; // being filled
+        volatile uint8_t rx_head;
+        volatile uint8_t rx_tail;
+        volatile uint8_t rx_ready; // complete slots waiting at rx_tail
         void validate_rx_buffer();
-        uint8_t rx_buffer_len;
-        uint8_t rx_buffer[MAX_PAYLOAD_LEN];
+        void receive_bit(bool bit);
+        void sense(bool clean);
+#if RADIO_FEC_LEN
+        void mark_erasure(uint8_t byte, uint8_t low_nibble);
+        bool correct_rx_buffer(RadioSlot* slot);
+#endif
+#if RADIO_RX_CAPTURE
+        volatile uint16_t rx_last_edge;
+        void receive_run(bool level, uint16_t width);
+#else
         void receive_timer();
+#endif
 
         // TODO: precompute these values
         // including timerCalc because might be useful in the future
         // if we want to change the speed
         static uint8_t timerCalc(uint16_t speed, uint16_t max_ticks, uint16_t *nticks);
-        static uint16_t updateCRC(uint16_t crc, uint8_t data);
         static uint8_t convert_to_4bit_symbols(uint8_t symbol);
 
     public:
+        // CRC-CCITT (0x8408), also used to digest flash pages
+        static uint16_t updateCRC(uint16_t crc, uint8_t data);
+
         Radio();
         bool init();
         bool available();
         bool recv(uint8_t* buf, uint8_t* len);
+        // zero-copy receive, the message stays valid until release()
+        bool recv_view(const uint8_t** buf, uint8_t* len);
+        void release();
         bool send(const uint8_t* data, uint8_t len);
         bool wait_packet_send();
+        bool sending();
+        // a transmitter was heard since the last call (only in Rx)
+        bool carrier();
         void handle_timer_interrupt();
+#if RADIO_RX_CAPTURE
+        void receive_edge();
+        void receive_flush();
+#endif
+
+        // headers
+        // the id is free for the application to use (waveboot uses
+        // it as the frame sequence number), flags carry protocol bits
+        // frames for other addresses are dropped while receiving,
+        // DEFAULT_ADDRESS hears everything, and is the default
+        // destination, every node takes it
+        void setAddress(uint8_t address); // also the from header of what's sent
+        void setHeaderTo(uint8_t to);
+        void setHeaderId(uint8_t id);
+        void setHeaderFlags(uint8_t flags);
+        uint8_t headerTo();
+        uint8_t headerFrom();
+        uint8_t headerId();
+        uint8_t headerFlags();
+
+#if RADIO_PROFILE
+        static uint16_t isrTicksMax();
+#endif
 
         // modes
         void set_mode_idle();
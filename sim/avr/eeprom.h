@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// EEPROM of the simulated MCU (sim/flash_sim.cpp), writes are instant
+uint8_t eeprom_read_byte(const uint8_t* address);
+void eeprom_update_byte(uint8_t* address, uint8_t value);
+uint16_t eeprom_read_word(const uint16_t* address);
+void eeprom_update_word(uint16_t* address, uint16_t value);
+void eeprom_read_block(void* dst, const void* src, size_t n);
+void eeprom_update_block(const void* src, void* dst, size_t n);
+#define eeprom_busy_wait() ((void)0)
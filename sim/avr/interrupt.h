@@ -0,0 +1,8 @@
+#pragma once
+
+#include <avr/io.h>
+
+// the simulator is single threaded and calls the handlers itself
+#define ISR(vector) extern "C" void vector(void)
+#define cli()
+#define sei()
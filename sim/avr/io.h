@@ -0,0 +1,59 @@
+/**
+ * Host stand-in for <avr/io.h>, just the registers and bits the
+ * radio uses. Every register is a plain field of sim_registers so
+ * a simulator can run several MCUs by swapping the whole set.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct sim_registers {
+    uint8_t ddrb, portb, pinb;
+    uint8_t ddrd, portd, pind;
+    uint8_t tccr1a, tccr1b, timsk1, tifr1;
+    uint16_t tcnt1, ocr1a, ocr1b, icr1;
+};
+
+// registers of the MCU being simulated right now
+extern sim_registers sim_regs;
+
+#define DDRB sim_regs.ddrb
+#define PORTB sim_regs.portb
+#define PINB sim_regs.pinb
+#define DDRD sim_regs.ddrd
+#define PORTD sim_regs.portd
+#define PIND sim_regs.pind
+#define TCCR1A sim_regs.tccr1a
+#define TCCR1B sim_regs.tccr1b
+#define TIMSK1 sim_regs.timsk1
+#define TIFR1 sim_regs.tifr1
+#define TCNT1 sim_regs.tcnt1
+#define OCR1A sim_regs.ocr1a
+#define OCR1B sim_regs.ocr1b
+#define ICR1 sim_regs.icr1
+
+#define PB0 0
+#define PB5 5
+#define PD5 5
+#define PD6 6
+
+// TCCR1B
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define ICES1 6
+#define ICNC1 7
+// TIMSK1 / TIFR1
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1 5
+#define OCF1A 1
+#define OCF1B 2
+#define ICF1 5
+
+#define FLASHEND 0x7FFF
+#define RAMEND 0x8FF
+#define E2END 0x3FF
+#define SPM_PAGESIZE 128
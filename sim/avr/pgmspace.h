@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// PROGMEM data stays in host memory
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t*)(address))
+#define pgm_read_word(address) (*(const uint16_t*)(address))
+#define memcpy_P memcpy
+#define pgm_read_ptr(address) (*(const void* const*)(address))
+
+// program memory of the simulated MCU (sim/flash_sim.cpp)
+uint8_t sim_flash_read(uint16_t address);
+#define pgm_read_byte_near(address) sim_flash_read((uint16_t)(address))
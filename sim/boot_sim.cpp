@@ -0,0 +1,223 @@
+/**
+ * Virtual bootloader
+ * Runs program_flash() from program.cpp against the flash model
+ * (flash_sim.cpp) with a scripted programmer on the radio
+ * (radio_script.cpp). Every update starts from erased flash and is
+ * checked against the image afterwards. Reports the simulated update
+ * time, radio traffic and flash wear, exits with 1 on a mismatched
+ * page, an application section read or an EEPROM write while SPM was
+ * busy, or a recovery marker left set after a finished update.
+ *
+ * With -c every update is cut short at a random frame first, then
+ * resumed from the page the node would report in RDY. With -u the
+ * image is pushed again after every update, which the node must
+ * answer with UTD without writing a page. With -o flash starts out
+ * full of an older image instead of erased, which the erase frames
+ * past the end of the image must clear, with -m it holds the image
+ * with a few bytes changed, like a rebuild being flashed over the
+ * last one. -f is the chance a page write leaves a bit wrong, the
+ * programmer sends a page the node reports failed again before
+ * FRAME_END, and the update must end in DNE unless the same page
+ * fails twice, then it's given up. -F sends every update as a fleet update
+ * (FLAG_MULTICAST), broadcast without ACKs and repaired with the
+ * pages the node reports missing when it's polled.
+ *
+ * Usage: boot_sim [-n updates] [-l loss] [-s random image bytes]
+ *                 [-c] [-u] [-o] [-m] [-f fault] [-F] [-r seed] [image.hex]
+ */
+
+#include "program.h"
+#include "sim.h"
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static SimFrame frames[SIM_MAX_FRAMES];
+static SimFrame resume_frames[SIM_MAX_FRAMES];
+
+static uint64_t sent, lost, overruns, timeouts, polls, repair_rounds;
+static bool fleet = false;
+
+static void tally_link(void) {
+    sent += sim_link_stats.sent;
+    lost += sim_link_stats.lost;
+    overruns += sim_link_stats.overruns;
+    timeouts += sim_link_stats.timeouts;
+    polls += sim_link_stats.polls;
+    repair_rounds += sim_link_stats.repair_rounds;
+}
+
+static void start_link(const SimFrame* frames, uint16_t count, double loss) {
+    if (fleet) {
+        sim_link_start_fleet(frames, count, loss);
+    } else {
+        sim_link_start(frames, count, loss);
+    }
+}
+
+int main(int argc, char** argv) {
+    uint32_t updates = 1000;
+    double loss = 0;
+    uint16_t size = 0;
+    long seed = 1;
+    bool cut = false;
+    bool again = false;
+    bool stale = false;
+    bool rebuild = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:s:cuomf:Fr:")) != -1) {
+        switch (opt) {
+            case 'n': updates = atol(optarg); break;
+            case 'l': loss = atof(optarg); break;
+            case 's': size = atoi(optarg); break;
+            case 'c': cut = true; break;
+            case 'u': again = true; break;
+            case 'o': stale = true; break;
+            case 'm': rebuild = true; break;
+            case 'f': sim_flash_fault = atof(optarg); break;
+            case 'F': fleet = true; break;
+            case 'r': seed = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n updates] [-l loss] [-s random image bytes] [-c] [-u] [-o] [-m] [-f fault] [-F] [-r seed] [image.hex]\n", argv[0]);
+                return 2;
+        }
+    }
+    srand48(seed);
+
+    if (optind < argc) {
+        if (!sim_image_read_hex(argv[optind])) {
+            fprintf(stderr, "can't read %s\n", argv[optind]);
+            return 1;
+        }
+    } else {
+        sim_image_random(size ? size : 8192);
+    }
+    uint16_t frame_count = sim_image_frames(frames, 0);
+
+    Radio driver;
+    uint32_t failed = 0;
+    uint32_t unconfirmed = 0; // written, but the DNE was lost
+    uint32_t bad_pages = 0; // after an update the node reported done
+    uint32_t rejected = 0; // BAD, a failed page got past FRAME_END
+    uint32_t repaired = 0; // pages sent again after an ACK named them
+    uint32_t given_up = 0; // a page failed again after that
+    uint32_t up_to_date = 0, rewritten = 0; // with -u
+    uint32_t rww_reads = 0;
+    uint32_t marked = 0; // recovery marker still set after success
+    uint32_t clashes = 0;
+    uint16_t worst_page_writes = 0;
+    uint64_t total_us = 0, stall_us = 0, writes = 0, skipped = 0, erases = 0, eeprom_writes = 0;
+    uint64_t resumed_pages = 0, resumed_frames = 0; // with -c
+    clock_t started = clock();
+
+    for (uint32_t u = 0; u < updates; u++) {
+        sim_flash_reset();
+        sim_us = 0;
+        if (stale) {
+            for (uint16_t i = 0; i < BOOT_START; i++) sim_flash[i] = lrand48();
+        }
+        if (rebuild) {
+            memcpy(sim_flash, sim_image, BOOT_START);
+            for (uint8_t i = 0; i < 8; i++) sim_flash[lrand48() % BOOT_START] ^= lrand48();
+        }
+        const SimFrame* update = frames;
+        uint16_t update_count = frame_count;
+
+        if (cut) {
+            // the programmer goes away before END, the node times out
+            sim_link_start(frames, 1 + lrand48() % (frame_count - 1), loss);
+            program_flash(driver);
+            tally_link();
+
+            // and comes back, picking up where RDY says
+            // a fleet update starts over, the node reports what it has
+            uint8_t state[UPDATE_STATE_LEN];
+            uint8_t manifest[MANIFEST_LEN];
+            read_update_state(state);
+            sim_image_manifest(manifest);
+            uint8_t resume_page = !fleet && memcmp(state, &manifest[2], 2) == 0 ? state[2] : 0;
+            update_count = sim_image_frames(resume_frames, resume_page);
+            update = resume_frames;
+            resumed_pages += resume_page;
+            resumed_frames += update_count;
+        }
+
+        start_link(update, update_count, loss);
+
+        bool updated = program_flash(driver);
+        if (sim_link_stats.rejected) rejected++;
+        repaired += sim_link_stats.repaired_pages;
+        if (sim_link_stats.bad_page) given_up++;
+        if (updated) {
+            if (!sim_link_stats.done) unconfirmed++;
+            bad_pages += sim_image_mismatches(sim_flash);
+            if (check_recovery_bytes()) marked++;
+        } else {
+            failed++;
+        }
+
+        total_us += sim_us;
+        stall_us += sim_flash_stats.stall_us;
+        tally_link();
+        writes += sim_flash_stats.writes;
+        skipped += sim_flash_stats.skipped;
+        erases += sim_flash_stats.erases;
+        rww_reads += sim_flash_stats.rww_reads;
+        eeprom_writes += sim_flash_stats.eeprom_writes;
+        clashes += sim_flash_stats.eeprom_spm_clashes;
+        for (uint16_t page = 0; page < SIM_FLASH_PAGES; page++) {
+            if (sim_flash_stats.page_writes[page] > worst_page_writes) {
+                worst_page_writes = sim_flash_stats.page_writes[page];
+            }
+        }
+
+        if (again && updated) {
+            uint32_t written = sim_flash_stats.writes;
+            start_link(frames, frame_count, loss);
+            if (!program_flash(driver) || sim_flash_stats.writes != written) {
+                rewritten++;
+            } else if (sim_link_stats.up_to_date) {
+                up_to_date++; // or the UTD was lost on the way back
+            }
+            tally_link();
+        }
+    }
+
+    double wall = (double)(clock() - started) / CLOCKS_PER_SEC;
+    double n = updates ? updates : 1;
+    printf("%lu updates, %u frames each, loss %g\n", (unsigned long)updates, frame_count, loss);
+    printf("failed %lu, DNE lost %lu\n", (unsigned long)failed, (unsigned long)unconfirmed);
+    printf("mismatched pages %lu, RWW reads while busy %lu, failed verification %lu\n",
+        (unsigned long)bad_pages, (unsigned long)rww_reads, (unsigned long)rejected);
+    if (sim_flash_fault) {
+        printf("pages sent again %.2f, given up on a page that failed twice %lu\n",
+            repaired / n, (unsigned long)given_up);
+    }
+    if (again) {
+        printf("pushed again: up to date %lu, written again %lu\n",
+            (unsigned long)up_to_date, (unsigned long)rewritten);
+    }
+    if (fleet) {
+        printf("fleet: polls %.1f, repair rounds %.1f\n", polls / n, repair_rounds / n);
+    }
+    if (cut) {
+        printf("cut short and resumed from page %.1f, %.1f of %u frames sent again\n",
+            resumed_pages / n, resumed_frames / n, frame_count);
+    }
+    printf("update time %.2fs, %.2fs waiting on flash\n", total_us / n / 1e6, stall_us / n / 1e6);
+    printf("frames sent %.1f, lost %.1f, overruns %.1f, ack timeouts %.1f\n",
+        sent / n, lost / n, overruns / n, timeouts / n);
+    printf("page writes %.1f, %.1f already in flash, erases %.1f, most writes to one page %u\n",
+        writes / n, skipped / n, erases / n, worst_page_writes);
+    printf("EEPROM writes %.1f, %lu while SPM was busy, marker left set %lu\n",
+        eeprom_writes / n, (unsigned long)clashes, (unsigned long)marked);
+    printf("%.0f updates per second\n", wall > 0 ? updates / wall : 0.0);
+    // a lossy link can fail an update, and a page that fails twice,
+    // a bad page or a read mid write is a bug
+    bool lost_update = !loss && failed > given_up;
+    return bad_pages || rww_reads || clashes || marked || rejected || lost_update || rewritten ? 1 : 0;
+}
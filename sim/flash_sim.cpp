@@ -0,0 +1,158 @@
+// flash.h on top of an in-memory flash
+// the erase and the write take as long as on the chip and run
+// "in the background" on the simulated clock, like SPM_READY_vect
+// plus the EEPROM, which like the chip can't be written mid SPM
+
+#include "flash.h"
+#include <avr/eeprom.h>
+#include "config.h"
+#include "sim.h"
+#include <stdlib.h>
+#include <string.h>
+
+// page erase and page write, worst case from the datasheet
+#define FLASH_ERASE_US 4500
+#define FLASH_WRITE_US 4500
+
+uint8_t sim_flash[SIM_FLASH_SIZE];
+uint8_t sim_eeprom[E2END + 1];
+SimFlashStats sim_flash_stats;
+double sim_flash_fault = 0;
+
+static uint64_t flash_done_us = 0;
+// like flash.cpp, the page written last is read back after it's done
+static bool verify_pending = false;
+static uint16_t verify_address;
+static uint8_t verify_data[SPM_PAGESIZE];
+static uint8_t failed_pages = 0;
+static uint16_t failed_address = 0xFFFF;
+
+void sim_flash_reset(void) {
+    memset(sim_flash, 0xFF, sizeof(sim_flash));
+    memset(sim_eeprom, 0xFF, sizeof(sim_eeprom));
+    memset(&sim_flash_stats, 0, sizeof(sim_flash_stats));
+    flash_done_us = 0;
+    verify_pending = false;
+    failed_pages = 0;
+    failed_address = 0xFFFF;
+}
+
+uint8_t sim_flash_read(uint16_t address) {
+    address &= FLASHEND;
+    // the RWW section reads as garbage until the operation is done
+    if (flash_busy() && address < BOOT_START) {
+        sim_flash_stats.rww_reads++;
+        return 0x00;
+    }
+    return sim_flash[address];
+}
+
+void flash_write_page(uint16_t page_address, const uint8_t* data) {
+    flash_wait();
+
+    page_address &= FLASHEND & ~(SPM_PAGESIZE - 1);
+    uint8_t* page = &sim_flash[page_address];
+    bool needs_erase = false;
+    for (uint8_t i = 0; i < SPM_PAGESIZE; i++) {
+        if ((page[i] & data[i]) != data[i]) needs_erase = true;
+    }
+    if (memcmp(page, data, SPM_PAGESIZE) == 0) {
+        sim_flash_stats.skipped++;
+        return;
+    }
+
+    // the page only changes once both steps are done, but nothing
+    // may read it before then anyway
+    // programming can only clear bits
+    if (needs_erase) memset(page, 0xFF, SPM_PAGESIZE);
+    for (uint8_t i = 0; i < SPM_PAGESIZE; i++) page[i] &= data[i];
+    // a worn page, one bit doesn't take
+    if (drand48() < sim_flash_fault) {
+        uint8_t at = lrand48() % SPM_PAGESIZE;
+        page[at] ^= 1 << (lrand48() % 8);
+    }
+    if (needs_erase) sim_flash_stats.erases++;
+    sim_flash_stats.writes++;
+    sim_flash_stats.page_writes[page_address / SPM_PAGESIZE]++;
+    flash_done_us = sim_us + (needs_erase ? FLASH_ERASE_US : 0) + FLASH_WRITE_US;
+    verify_pending = true;
+    verify_address = page_address;
+    memcpy(verify_data, data, SPM_PAGESIZE);
+
+    // the CPU halts while NRWW is programmed
+    if (page_address >= BOOT_START) flash_wait();
+}
+
+void flash_erase_page(uint16_t page_address) {
+    flash_wait();
+
+    page_address &= FLASHEND & ~(SPM_PAGESIZE - 1);
+    memset(&sim_flash[page_address], 0xFF, SPM_PAGESIZE);
+    sim_flash_stats.erases++;
+    flash_done_us = sim_us + FLASH_ERASE_US;
+
+    if (page_address >= BOOT_START) flash_wait();
+}
+
+bool flash_busy(void) {
+    return sim_us < flash_done_us;
+}
+
+void flash_wait(void) {
+    if (flash_busy()) {
+        // the programmer keeps sending while the node waits
+        sim_link_run_until(flash_done_us);
+        sim_flash_stats.stall_us += flash_done_us - sim_us;
+        sim_us = flash_done_us;
+    }
+
+    if (!verify_pending) return;
+    verify_pending = false;
+    if (memcmp(&sim_flash[verify_address], verify_data, SPM_PAGESIZE) != 0) {
+        if (failed_pages != 0xFF) failed_pages++;
+        failed_address = verify_address;
+    }
+}
+
+uint8_t flash_failed_pages(void) {
+    return failed_pages;
+}
+
+uint16_t flash_failed_page(void) {
+    return failed_address;
+}
+
+uint8_t eeprom_read_byte(const uint8_t* address) {
+    return sim_eeprom[(uintptr_t)address & E2END];
+}
+
+void eeprom_update_byte(uint8_t* address, uint8_t value) {
+    uint8_t* cell = &sim_eeprom[(uintptr_t)address & E2END];
+    if (*cell == value) return;
+    // the chip ignores it
+    if (flash_busy()) {
+        sim_flash_stats.eeprom_spm_clashes++;
+        return;
+    }
+    *cell = value;
+    sim_flash_stats.eeprom_writes++;
+}
+
+uint16_t eeprom_read_word(const uint16_t* address) {
+    const uint8_t* bytes = (const uint8_t*)address;
+    return eeprom_read_byte(bytes) | (eeprom_read_byte(bytes + 1) << 8);
+}
+
+void eeprom_update_word(uint16_t* address, uint16_t value) {
+    uint8_t* bytes = (uint8_t*)address;
+    eeprom_update_byte(bytes, value & 0xFF);
+    eeprom_update_byte(bytes + 1, value >> 8);
+}
+
+void eeprom_read_block(void* dst, const void* src, size_t n) {
+    for (size_t i = 0; i < n; i++) ((uint8_t*)dst)[i] = eeprom_read_byte((const uint8_t*)src + i);
+}
+
+void eeprom_update_block(const void* src, void* dst, size_t n) {
+    for (size_t i = 0; i < n; i++) eeprom_update_byte((uint8_t*)dst + i, ((const uint8_t*)src)[i]);
+}
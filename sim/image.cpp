@@ -0,0 +1,153 @@
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint8_t sim_image[SIM_FLASH_SIZE];
+
+static uint8_t hex_byte(const char* s) {
+    char digits[3] = { s[0], s[1], 0 };
+    return strtol(digits, NULL, 16);
+}
+
+static void image_clear(void) {
+    memset(sim_image, 0xFF, sizeof(sim_image));
+}
+
+// data records only, like image.read_pages()
+bool sim_image_read_hex(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (!f) return false;
+
+    char line[600];
+    uint32_t base = 0;
+    image_clear();
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] != ':' || strlen(line) < 11) continue;
+        uint8_t count = hex_byte(line + 1);
+        uint16_t address = (hex_byte(line + 3) << 8) | hex_byte(line + 5);
+        uint8_t type = hex_byte(line + 7);
+        if (strlen(line) < 11u + count * 2) break;
+
+        if (type == 0x00) {
+            for (uint8_t i = 0; i < count; i++) {
+                uint32_t at = base + address + i;
+                if (at >= BOOT_START) {
+                    fclose(f);
+                    return false;
+                }
+                sim_image[at] = hex_byte(line + 9 + i * 2);
+            }
+        } else if (type == 0x01) {
+            break;
+        } else if (type == 0x02) {
+            base = ((hex_byte(line + 9) << 8) | hex_byte(line + 11)) << 4;
+        } else if (type == 0x04) {
+            base = (uint32_t)((hex_byte(line + 9) << 8) | hex_byte(line + 11)) << 16;
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+void sim_image_random(uint16_t size) {
+    image_clear();
+    if (size > BOOT_START) size = BOOT_START;
+    for (uint16_t i = 0; i < size; i++) {
+        sim_image[i] = (lrand48() & 3) ? lrand48() : 0;
+    }
+}
+
+static bool page_blank(uint16_t page) {
+    for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+        if (sim_image[page * SPM_PAGESIZE + i] != 0xFF) return false;
+    }
+    return true;
+}
+
+// end of the last page that isn't blank, the image counts from 0
+static uint16_t image_len(void) {
+    uint16_t pages = BOOT_START / SPM_PAGESIZE;
+    while (pages && page_blank(pages - 1)) pages--;
+    return pages * SPM_PAGESIZE;
+}
+
+static uint32_t crc32(const uint8_t* data, uint16_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint16_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+void sim_image_manifest(uint8_t* manifest) {
+    uint16_t len = image_len();
+    uint32_t crc = crc32(sim_image, len);
+    manifest[0] = len & 0xFF;
+    manifest[1] = len >> 8;
+    for (uint8_t i = 0; i < 4; i++) manifest[2 + i] = crc >> (8 * i);
+    manifest[6] = 0;
+    manifest[7] = 0;
+}
+
+uint16_t sim_image_page_frames(SimFrame* frames, uint16_t page) {
+    uint8_t chunk = RADIO_MAX_MESSAGE_LEN - FRAME_DATA_HEADER_LEN;
+    uint16_t count = 0;
+    uint16_t page_addr = page * SPM_PAGESIZE;
+    uint8_t end = SPM_PAGESIZE;
+    while (end && sim_image[page_addr + end - 1] == 0xFF) end--;
+
+    uint8_t offset = 0;
+    do {
+        SimFrame* frame = &frames[count++];
+        uint16_t address = page_addr + offset;
+        uint8_t len = end > offset ? end - offset : 0;
+        if (len > chunk) len = chunk;
+        frame->data[0] = FRAME_DATA;
+        frame->data[1] = address >> 8;
+        frame->data[2] = address & 0xFF;
+        memcpy(frame->data + FRAME_DATA_HEADER_LEN, &sim_image[address], len);
+        frame->len = FRAME_DATA_HEADER_LEN + len;
+        offset += chunk;
+    } while (offset < end);
+    return count;
+}
+
+uint16_t sim_image_frames(SimFrame* frames, uint8_t first_page) {
+    uint16_t count = 0;
+
+    frames[count].data[0] = FRAME_BEGIN;
+    sim_image_manifest(frames[count].data + 1);
+    frames[count++].len = 1 + MANIFEST_LEN;
+
+    for (uint16_t page = first_page; page < BOOT_START / SPM_PAGESIZE; page++) {
+        // a run of blank pages, up to the bootloader like ERASE_TAIL in program.py
+        if (page_blank(page)) {
+            uint8_t run = 1;
+            while (run < SIM_ERASE_MAX_PAGES && page + run < BOOT_START / SPM_PAGESIZE && page_blank(page + run)) run++;
+            SimFrame* frame = &frames[count++];
+            frame->data[0] = FRAME_ERASE;
+            frame->data[1] = page;
+            frame->data[2] = run;
+            frame->len = 3;
+            page += run - 1;
+            continue;
+        }
+
+        count += sim_image_page_frames(&frames[count], page);
+    }
+
+    frames[count].data[0] = FRAME_END;
+    frames[count].len = 1;
+    return count + 1;
+}
+
+uint16_t sim_image_mismatches(const uint8_t* flash) {
+    uint16_t bad = 0;
+    for (uint16_t page_addr = 0; page_addr < BOOT_START; page_addr += SPM_PAGESIZE) {
+        if (memcmp(&flash[page_addr], &sim_image[page_addr], SPM_PAGESIZE) != 0) bad++;
+    }
+    return bad;
+}
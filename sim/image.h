@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+#include "program.h"
+#include "sim.h"
+
+// firmware image for the simulated programmers, application section only
+extern uint8_t sim_image[SIM_FLASH_SIZE];
+
+#define SIM_FRAMES_PER_PAGE (SPM_PAGESIZE / (RADIO_MAX_MESSAGE_LEN - FRAME_DATA_HEADER_LEN) + 1)
+#define SIM_MAX_FRAMES (BOOT_START / SPM_PAGESIZE * SIM_FRAMES_PER_PAGE + 2)
+#define SIM_ERASE_MAX_PAGES 32 // image.ERASE_MAX_PAGES
+
+// false if the file can't be read or overlaps the bootloader
+// records land in their page whatever order they come in
+bool sim_image_read_hex(const char* filename);
+// code-like bytes, plenty of repeats and zeros
+void sim_image_random(uint16_t size);
+// same as image.manifest() with version 0, MANIFEST_LEN bytes
+void sim_image_manifest(uint8_t* manifest);
+// FRAME_BEGIN, the pages from first_page on split like
+// image.page_frames(), then FRAME_END
+// like image.build_frames(), blank pages up to the bootloader go
+// out as FRAME_ERASE ranges
+// frames must hold SIM_MAX_FRAMES, returns how many were made
+uint16_t sim_image_frames(SimFrame* frames, uint8_t first_page);
+// the data frames of one page, like image.page_frames(), a page
+// that didn't read back as written goes out again with these
+// frames must hold SIM_FRAMES_PER_PAGE, returns how many were made
+uint16_t sim_image_page_frames(SimFrame* frames, uint16_t page);
+// pages of the application section that differ from the image
+uint16_t sim_image_mismatches(const uint8_t* flash);
@@ -0,0 +1,428 @@
+// Radio for the virtual bootloader, no codec, whole frames are handed
+// over on the simulated clock
+// the other end is a programmer running the sliding window (program.h):
+// bursts of up to WINDOW_SIZE frames, the last one flagged for an ACK,
+// resent after ACK_TIMEOUT_US, given up after SEND_ATTEMPTS, the
+// pages an ACK names as failed are sent again before FRAME_END
+// or a fleet update: the frames go out once without ACKs, the node
+// is polled for the pages it's missing, those go out again, and
+// FRAME_END is sent to it once it has them all
+
+#include "config.h"
+#include "radio.h"
+#include "program.h"
+#include "sim.h"
+#include "image.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ACK_TIMEOUT_US 400000 // same as the bridge
+#define SEND_ATTEMPTS 6
+#define FLEET_ADDRESS 1 // the node's, polls and FRAME_END go to it
+#define FLEET_REPAIR_ROUNDS 10 // same as program.py
+
+enum FleetPhase {
+    FLEET_BROADCAST,
+    FLEET_POLL,
+    FLEET_END
+};
+
+struct InboxFrame {
+    uint64_t arrival_us;
+    uint8_t id;
+    uint8_t flags;
+    uint8_t to;
+    const SimFrame* frame;
+};
+
+// frames that made it into a receive slot
+static InboxFrame inbox[RADIO_RX_SLOTS];
+static uint8_t inbox_head;
+static uint8_t inbox_count;
+
+SimLinkStats sim_link_stats;
+
+// the frames as they go out, failed pages are put in before FRAME_END,
+// each one once
+static SimFrame link_frames[2 * SIM_MAX_FRAMES];
+
+static struct {
+    SimFrame* frames;
+    uint16_t count;
+    double loss;
+    uint16_t base; // oldest frame without an ACK
+    uint8_t acked; // bitmap of frames past base the node holds
+    uint8_t burst_pos;
+    bool waiting; // for the ACK of a burst
+    uint64_t deadline_us;
+    uint64_t free_us; // the programmer's radio is idle from then on
+    uint8_t attempts;
+    bool finished;
+    // first frame of each page sent again, 0 until it is
+    uint16_t repaired[BOOT_START / SPM_PAGESIZE];
+    // fleet update
+    bool fleet;
+    uint8_t phase;
+    uint16_t pos; // next frame of the broadcast
+    uint8_t rounds; // broadcasts after the first
+    bool begin; // FRAME_BEGIN goes out again
+    uint8_t missing[POLL_BITMAP_LEN]; // as the node reported them
+} link;
+
+static const SimFrame poll_frame = { 1, { FRAME_POLL } };
+
+// preamble plus count, headers, message, crc and parity, 2 symbols a byte
+static uint64_t airtime_us(uint8_t len) {
+    uint32_t symbols = PREAMBLE_LEN + (len + RADIO_HEADER_LEN + 3 + RADIO_FEC_LEN) * 2;
+    return (uint64_t)symbols * 6 * 1000000 / RADIO_SPEED;
+}
+
+static bool lost() {
+    if (drand48() >= link.loss) return false;
+    sim_link_stats.lost++;
+    return true;
+}
+
+static uint8_t window_len() {
+    uint16_t left = link.count - link.base;
+    return left < WINDOW_SIZE ? left : WINDOW_SIZE;
+}
+
+static bool next_unacked(uint8_t* pos) {
+    for (; *pos < window_len(); (*pos)++) {
+        if (!(link.acked & (1 << *pos))) return true;
+    }
+    return false;
+}
+
+void sim_link_start(const SimFrame* frames, uint16_t count, double loss) {
+    memset(&link, 0, sizeof(link));
+    memset(&sim_link_stats, 0, sizeof(sim_link_stats));
+    memcpy(link_frames, frames, count * sizeof(SimFrame));
+    link.frames = link_frames;
+    link.count = count;
+    link.loss = loss;
+    link.free_us = sim_us;
+    inbox_head = 0;
+    inbox_count = 0;
+}
+
+void sim_link_start_fleet(const SimFrame* frames, uint16_t count, double loss) {
+    sim_link_start(frames, count, loss);
+    link.fleet = true;
+    link.phase = FLEET_BROADCAST;
+}
+
+static uint64_t next_action_us() {
+    return link.waiting ? link.deadline_us : link.free_us;
+}
+
+// onto the air, and into the node's receive slots if it isn't lost
+static void transmit(const SimFrame* frame, uint8_t id, uint8_t flags, uint8_t to) {
+    link.free_us += airtime_us(frame->len);
+    sim_link_stats.sent++;
+
+    if (lost()) return;
+    if (inbox_count == RADIO_RX_SLOTS) {
+        sim_link_stats.overruns++;
+        return;
+    }
+    InboxFrame* in = &inbox[(inbox_head + inbox_count++) % RADIO_RX_SLOTS];
+    in->arrival_us = link.free_us;
+    in->id = id;
+    in->flags = flags;
+    in->to = to;
+    in->frame = frame;
+}
+
+// page of a data frame, -1 for every other kind
+static int16_t data_page(uint16_t index) {
+    const uint8_t* data = link.frames[index].data;
+    if (data[0] != FRAME_DATA && data[0] != FRAME_ZDATA) return -1;
+    return ((data[1] << 8) | data[2]) / SPM_PAGESIZE;
+}
+
+static bool page_missing(uint16_t page) {
+    return link.missing[page / 8] & (1 << (page % 8));
+}
+
+// the first broadcast is everything but FRAME_END, the repairs
+// are whole pages
+static bool fleet_wanted(uint16_t index) {
+    if (link.rounds == 0) return true;
+
+    const uint8_t* data = link.frames[index].data;
+    if (data[0] == FRAME_BEGIN) return link.begin;
+    if (data[0] == FRAME_ERASE) {
+        for (uint16_t page = data[1]; page < data[1] + data[2]; page++) {
+            if (page_missing(page)) return true;
+        }
+        return false;
+    }
+    int16_t page = data_page(index);
+    return page >= 0 && page_missing(page);
+}
+
+// multicast_headers() in program.py, the id is the frame's place
+// in its page and the last one is flagged
+static void fleet_broadcast(uint16_t index) {
+    int16_t page = data_page(index);
+    uint8_t part = 0;
+    while (page >= 0 && part < index && data_page(index - part - 1) == page) part++;
+    bool last = page < 0 || index + 1 >= link.count || data_page(index + 1) != page;
+    transmit(&link.frames[index], part, FLAG_MULTICAST | (last ? FLAG_PAGE_END : 0), DEFAULT_ADDRESS);
+}
+
+// a frame of the broadcast, or a poll or FRAME_END to the node,
+// asked again if the answer doesn't come
+static void fleet_act() {
+    if (link.waiting) {
+        link.waiting = false;
+        sim_link_stats.timeouts++;
+        if (++link.attempts >= SEND_ATTEMPTS) {
+            link.finished = true;
+            return;
+        }
+        link.free_us = link.deadline_us;
+    } else if (link.phase == FLEET_BROADCAST) {
+        while (link.pos < link.count - 1 && !fleet_wanted(link.pos)) link.pos++;
+        if (link.pos < link.count - 1) {
+            fleet_broadcast(link.pos++);
+            return;
+        }
+        link.phase = FLEET_POLL;
+    }
+
+    if (link.phase == FLEET_POLL) {
+        transmit(&poll_frame, 0, 0, FLEET_ADDRESS);
+    } else {
+        transmit(&link.frames[link.count - 1], 0, FLAG_MULTICAST, FLEET_ADDRESS);
+    }
+    link.waiting = true;
+    link.deadline_us = link.free_us + ACK_TIMEOUT_US;
+}
+
+// <'N'><'A'><'K'><status><bitmap>, what to send next
+static void fleet_receive_poll(const uint8_t* data) {
+    link.waiting = false;
+    link.attempts = 0;
+    sim_link_stats.polls++;
+
+    uint8_t status = data[3];
+    bool missing = false;
+    memcpy(link.missing, &data[4], POLL_BITMAP_LEN);
+    for (uint8_t i = 0; i < POLL_BITMAP_LEN; i++) missing |= link.missing[i] != 0;
+    link.begin = !(status & POLL_HAS_MANIFEST);
+
+    if ((status & POLL_UP_TO_DATE) || (!link.begin && !missing)) {
+        link.phase = FLEET_END;
+    } else if (link.rounds == FLEET_REPAIR_ROUNDS) {
+        // given up, the node never gets FRAME_END and times out
+        link.finished = true;
+    } else {
+        link.rounds++;
+        sim_link_stats.repair_rounds++;
+        link.phase = FLEET_BROADCAST;
+        link.pos = 0;
+    }
+    if (link.free_us < sim_us) link.free_us = sim_us;
+}
+
+// one frame on the air, or give up waiting for an ACK
+static void act() {
+    if (link.fleet) {
+        fleet_act();
+        return;
+    }
+
+    if (link.waiting) {
+        link.waiting = false;
+        link.burst_pos = 0;
+        sim_link_stats.timeouts++;
+        if (++link.attempts >= SEND_ATTEMPTS) link.finished = true;
+        link.free_us = link.deadline_us;
+        return;
+    }
+
+    if (!next_unacked(&link.burst_pos)) {
+        link.finished = true; // nothing left, only happens past END
+        return;
+    }
+
+    uint16_t index = link.base + link.burst_pos++;
+    uint8_t pos = link.burst_pos;
+    bool last = !next_unacked(&pos);
+    transmit(&link.frames[index], index, last ? FLAG_ACK_REQUEST : 0, DEFAULT_ADDRESS);
+    if (last) {
+        link.waiting = true;
+        link.deadline_us = link.free_us + ACK_TIMEOUT_US;
+    }
+}
+
+void sim_link_run_until(uint64_t us) {
+    while (!link.finished && next_action_us() < us) act();
+}
+
+// a failed page goes again right before FRAME_END, like run_window()
+// in program.py, still failed once the node is past the first of
+// those frames, it's a bad page and the update is given up
+static void repair_page(uint16_t page) {
+    if (link.repaired[page]) {
+        if (link.base > link.repaired[page]) {
+            sim_link_stats.bad_page = true;
+            link.finished = true;
+        }
+        return;
+    }
+    // cut short, there is no FRAME_END to put it before
+    SimFrame end = link.frames[link.count - 1];
+    if (end.data[0] != FRAME_END) {
+        link.finished = true;
+        return;
+    }
+
+    uint16_t first = link.count - 1;
+    link.count += sim_image_page_frames(&link.frames[first], page);
+    link.frames[link.count - 1] = end;
+    link.repaired[page] = first;
+    sim_link_stats.repaired_pages++;
+    // a FRAME_END the node holds is refused while the page is
+    // failed, its id now belongs to the page
+    uint16_t held = first - link.base;
+    if (held < WINDOW_SIZE) link.acked &= (1 << held) - 1;
+}
+
+// <'A'><'C'><'K'><next expected id><bitmap><failed pages>, or the end of the
+// update: <'D'><'N'><'E'>, <'U'><'T'><'D'> or <'B'><'A'><'D'>
+// a fleet update gets <'N'><'A'><'K'><status><bitmap> for its polls
+static void programmer_receive(const uint8_t* data, uint8_t len) {
+    if (link.fleet && link.phase == FLEET_POLL && link.waiting &&
+        len >= 4 + POLL_BITMAP_LEN && memcmp(data, "NAK", 3) == 0) {
+        fleet_receive_poll(data);
+        return;
+    }
+    if (len >= 3 && memcmp(data, "DNE", 3) == 0) {
+        sim_link_stats.done = true;
+        link.finished = true;
+        return;
+    }
+    if (len >= 3 && memcmp(data, "UTD", 3) == 0) {
+        sim_link_stats.up_to_date = true;
+        link.finished = true;
+        return;
+    }
+    if (len >= 3 && memcmp(data, "BAD", 3) == 0) {
+        sim_link_stats.rejected = true;
+        link.finished = true;
+        return;
+    }
+    if (len < 5 || memcmp(data, "ACK", 3) != 0) return;
+
+    uint8_t done = data[3] - (uint8_t)link.base;
+    if (done > window_len()) return; // stale
+    if (done) link.attempts = 0;
+    link.base += done;
+    link.acked = data[4];
+    link.burst_pos = 0;
+    link.waiting = false;
+    if (link.free_us < sim_us) link.free_us = sim_us;
+
+    for (uint8_t i = 0; 5 + i < len; i++) {
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            if (data[5 + i] & (1 << bit)) repair_page(i * 8 + bit);
+        }
+    }
+}
+
+Radio::Radio() {}
+
+bool Radio::init() {
+    return true;
+}
+
+bool Radio::available() {
+    if (inbox_count == 0) {
+        if (link.finished) {
+            // nothing more is coming, let the node's timeouts run
+            sim_us += 1000;
+            return false;
+        }
+        uint64_t at = next_action_us();
+        if (sim_us < at) sim_us = at;
+        act();
+        if (inbox_count == 0) return false;
+    }
+
+    if (sim_us < inbox[inbox_head].arrival_us) sim_us = inbox[inbox_head].arrival_us;
+    return true;
+}
+
+bool Radio::recv(uint8_t* buffer, uint8_t* len) {
+    const uint8_t* message;
+    uint8_t message_len;
+    if (!this->recv_view(&message, &message_len)) return false;
+
+    if (buffer && len) {
+        if (*len > message_len) *len = message_len;
+        memcpy(buffer, message, *len);
+    }
+
+    this->release();
+    return true;
+}
+
+bool Radio::recv_view(const uint8_t** buffer, uint8_t* len) {
+    if (!this->available()) return false;
+    *buffer = inbox[inbox_head].frame->data;
+    *len = inbox[inbox_head].frame->len;
+    return true;
+}
+
+void Radio::release() {
+    if (!inbox_count) return;
+    inbox_head = (inbox_head + 1) % RADIO_RX_SLOTS;
+    inbox_count--;
+}
+
+bool Radio::send(const uint8_t* data, uint8_t len) {
+    sim_us += airtime_us(len);
+    if (!lost()) programmer_receive(data, len);
+    return true;
+}
+
+bool Radio::wait_packet_send() {
+    return true;
+}
+
+bool Radio::sending() {
+    return false;
+}
+
+// a single node, FLEET_ADDRESS in a fleet update
+void Radio::setAddress(uint8_t address) {}
+void Radio::setHeaderTo(uint8_t to) {}
+void Radio::setHeaderId(uint8_t id) {}
+void Radio::setHeaderFlags(uint8_t flags) {}
+
+uint8_t Radio::headerTo() {
+    return inbox_count ? inbox[inbox_head].to : DEFAULT_ADDRESS;
+}
+
+uint8_t Radio::headerFrom() {
+    return DEFAULT_ADDRESS;
+}
+
+uint8_t Radio::headerId() {
+    return inbox_count ? inbox[inbox_head].id : 0;
+}
+
+uint8_t Radio::headerFlags() {
+    return inbox_count ? inbox[inbox_head].flags : 0;
+}
+
+// same as radio.cpp
+uint16_t Radio::updateCRC(uint16_t crc, uint8_t data) {
+    data ^= crc & 0xFF;
+    data ^= data << 4;
+    return (((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3);
+}
@@ -0,0 +1,325 @@
+/**
+ * Loopback simulator for the radio codec
+ * A transmitting and a receiving Radio, each with its own register
+ * set, the transmitter's RADIO_TX_PIN drives the receiver's
+ * RADIO_RX_PIN (ICP1 with RADIO_RX_CAPTURE) through a simulated
+ * channel. Reports frame error rate and effective throughput, and
+ * how often carrier sense fires on frames and on receiver noise.
+ *
+ * Time is counted in CPU cycles of the receiver, the transmitter's
+ * clock is off by the skew. With -p the receiver is only read after
+ * every that many frames, the ones in between are sent back to back
+ * and only what fits in the receive slots (RADIO_RX_SLOTS) is kept.
+ *
+ * Usage: radio_sim [-n frames] [-l message len] [-e bit error rate]
+ *                  [-b burst chance] [-B burst bits] [-s clock skew]
+ *                  [-d dropout chance] [-D dropout bits] [-r seed]
+ *                  [-q ms of noise] [-Q noise run bits] [-p frames per read]
+ */
+
+#include "radio.h"
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#define BIT_CYCLES (F_CPU / RADIO_SPEED)
+#define TAIL_BITS 24 // quiet line after every frame, covers the capture flush
+#define MAX_UNREAD 16 // -p
+
+struct Node {
+    Radio radio;
+    sim_registers regs;
+};
+
+struct Channel {
+    double ber; // chance of each bit being flipped
+    double burst_chance; // per frame, burst_bits of random levels
+    uint16_t burst_bits;
+    double skew; // transmitter clock error, 0.01 is 1% slow
+    double dropout_chance; // per frame, the receiver hears nothing for dropout_bits
+    uint16_t dropout_bits;
+    double noise_bits; // mean run of receiver noise with nobody on the air
+};
+
+struct Stats {
+    uint32_t received;
+    uint32_t corrupt; // delivered with the wrong contents
+    uint32_t interrupts; // receiver only
+    uint32_t sensed; // frames carrier sense fired on
+    uint32_t noise_sensed; // ms of noise carrier sense fired in
+    double cycles;
+};
+
+// frames sent since the receiver was last read
+struct Sent {
+    uint8_t message[RADIO_MAX_MESSAGE_LEN];
+    uint8_t len;
+    uint8_t id;
+    bool received;
+};
+
+static Node tx;
+static Node rx;
+static Channel channel;
+static Stats stats;
+static Sent unread[MAX_UNREAD];
+static uint8_t unread_count;
+
+// load a node's registers, the radio code only ever sees sim_regs
+static void select(Node* node) {
+    static Node* selected = NULL;
+    if (selected == node) return;
+    if (selected) selected->regs = sim_regs;
+    sim_regs = node->regs;
+    selected = node;
+}
+
+// impairments are placed per frame, in bits from the frame start
+struct Impairments {
+    int32_t burst_start;
+    int32_t dropout_start;
+};
+
+static bool channel_level(bool level, int32_t bit, const Impairments* imp) {
+    if (drand48() < channel.ber) level = !level;
+    if (bit >= imp->burst_start && bit < imp->burst_start + channel.burst_bits) {
+        level = lrand48() & 1;
+    }
+    if (bit >= imp->dropout_start && bit < imp->dropout_start + channel.dropout_bits) {
+        level = false;
+    }
+    return level;
+}
+
+#if RADIO_RX_CAPTURE
+static bool line_level = false;
+static bool flush_armed = false;
+static double flush_at;
+
+static uint16_t timer1(double cycles) {
+    return (uint16_t)((uint64_t)cycles / 8); // prescaler 8
+}
+
+// the compare B flush if its time came before now
+static void run_flush(double now) {
+    if (!flush_armed || flush_at > now) return;
+    select(&rx);
+    flush_armed = false;
+    if (TIMSK1 & (1 << OCIE1B)) {
+        TCNT1 = OCR1B;
+        rx.radio.receive_flush();
+        stats.interrupts++;
+    }
+}
+
+// the line holds level from start to end
+static void receive_span(bool level, double start, double end) {
+    run_flush(start);
+    if (level != line_level) {
+        line_level = level;
+        select(&rx);
+        if (level) {
+            PINB |= (1 << RADIO_CAPTURE_BIT);
+        } else {
+            PINB &= ~(1 << RADIO_CAPTURE_BIT);
+        }
+        // the capture unit only sees the edge it was set up for
+        if ((TIMSK1 & (1 << ICIE1)) && !(TCCR1B & (1 << ICES1)) == !level) {
+            ICR1 = TCNT1 = timer1(start);
+            rx.radio.receive_edge();
+            stats.interrupts++;
+            flush_armed = TIMSK1 & (1 << OCIE1B);
+            flush_at = start + (uint16_t)(OCR1B - ICR1) * 8.0;
+        }
+    }
+    run_flush(end);
+}
+#else
+static double next_sample = 0;
+
+// the line holds level from start to end
+// the samples are on their own clock, start only matters to the capture build
+static void receive_span(bool level, double start, double end) {
+    (void)start;
+    select(&rx);
+    if (level) {
+        PIND |= (1 << RADIO_RX_PIN);
+    } else {
+        PIND &= ~(1 << RADIO_RX_PIN);
+    }
+    for (; next_sample < end; next_sample += BIT_CYCLES / RADIO_RX_SAMPLES_PER_BIT) {
+        rx.radio.handle_timer_interrupt();
+        stats.interrupts++;
+    }
+}
+#endif
+
+// everything the receiver holds, each has to be one of the unread frames
+static void check_received() {
+    const uint8_t* buffer;
+    uint8_t buffer_len;
+
+    select(&rx);
+    while (rx.radio.recv_view(&buffer, &buffer_len)) {
+        bool matched = false;
+        for (uint8_t i = 0; i < unread_count && !matched; i++) {
+            Sent* sent = &unread[i];
+            matched = !sent->received && buffer_len == sent->len && rx.radio.headerId() == sent->id &&
+                memcmp(buffer, sent->message, sent->len) == 0;
+            sent->received |= matched;
+        }
+        if (matched) {
+            stats.received++;
+        } else {
+            stats.corrupt++;
+        }
+        rx.radio.release();
+    }
+}
+
+// poll reads the receiver every bit, like available() in a loop
+static void run_frame(const uint8_t* message, uint8_t len, uint8_t id, bool poll) {
+    double bit_cycles = BIT_CYCLES * (1 + channel.skew);
+    uint16_t frame_bits = (PREAMBLE_LEN + (len + RADIO_HEADER_LEN + 3 + RADIO_FEC_LEN) * 2) * 6;
+    Impairments imp = { -1 - (int32_t)channel.burst_bits, -1 - (int32_t)channel.dropout_bits };
+
+    if (drand48() < channel.burst_chance) imp.burst_start = lrand48() % frame_bits;
+    if (drand48() < channel.dropout_chance) imp.dropout_start = lrand48() % frame_bits;
+
+    select(&tx);
+    tx.radio.setHeaderId(id);
+    tx.radio.send(message, len);
+
+    // one transmitter interrupt per bit, it sets the pin for the next bit
+    int32_t bit = 0;
+    for (bool sending = true; sending || bit < frame_bits + TAIL_BITS; bit++) {
+        select(&tx);
+        if (sending) {
+            tx.radio.handle_timer_interrupt();
+            sending = tx.radio.sending();
+        }
+        bool level = channel_level(sending && (PORTD & (1 << RADIO_TX_PIN)), bit, &imp);
+
+        double start = stats.cycles;
+        stats.cycles += bit_cycles;
+        receive_span(level, start, stats.cycles);
+        if (poll) check_received();
+    }
+
+    select(&rx);
+    if (rx.radio.carrier()) stats.sensed++;
+}
+
+// an idle receiver turns up its gain and outputs noise, random
+// levels with exponential run lengths, polled every ms like
+// listen_for_boot_signal() does
+static void run_noise(uint32_t ms) {
+    bool level = false;
+    double run_end = stats.cycles;
+
+    for (uint32_t i = 0; i < ms; i++) {
+        double poll = stats.cycles + F_CPU / 1000.0;
+        while (stats.cycles < poll) {
+            if (stats.cycles >= run_end) {
+                level = !level;
+                run_end = stats.cycles - log(1 - drand48()) * BIT_CYCLES * channel.noise_bits;
+            }
+            double end = run_end < poll ? run_end : poll;
+            receive_span(level, stats.cycles, end);
+            stats.cycles = end;
+        }
+        select(&rx);
+        if (rx.radio.carrier()) stats.noise_sensed++;
+    }
+    receive_span(false, stats.cycles, stats.cycles);
+}
+
+int main(int argc, char** argv) {
+    uint32_t frames = 1000;
+    uint8_t len = RADIO_MAX_MESSAGE_LEN;
+    long seed = 1;
+    uint32_t noise_ms = 0;
+    uint32_t per_read = 1;
+    int opt;
+    channel.noise_bits = 0.25;
+
+    while ((opt = getopt(argc, argv, "n:l:e:b:B:s:d:D:r:q:Q:p:")) != -1) {
+        switch (opt) {
+            case 'n': frames = atol(optarg); break;
+            case 'l': len = atoi(optarg); break;
+            case 'e': channel.ber = atof(optarg); break;
+            case 'b': channel.burst_chance = atof(optarg); break;
+            case 'B': channel.burst_bits = atoi(optarg); break;
+            case 's': channel.skew = atof(optarg); break;
+            case 'd': channel.dropout_chance = atof(optarg); break;
+            case 'D': channel.dropout_bits = atoi(optarg); break;
+            case 'r': seed = atol(optarg); break;
+            case 'q': noise_ms = atol(optarg); break;
+            case 'Q': channel.noise_bits = atof(optarg); break;
+            case 'p': per_read = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n frames] [-l message len] [-e bit error rate]\n"
+                    "  [-b burst chance] [-B burst bits] [-s clock skew]\n"
+                    "  [-d dropout chance] [-D dropout bits] [-r seed]\n"
+                    "  [-q ms of noise] [-Q noise run bits] [-p frames per read]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (len > RADIO_MAX_MESSAGE_LEN) len = RADIO_MAX_MESSAGE_LEN;
+    if (per_read < 1) per_read = 1;
+    if (per_read > MAX_UNREAD) per_read = MAX_UNREAD;
+    srand48(seed);
+
+    select(&tx);
+    if (!tx.radio.init()) return 1;
+    select(&rx);
+    if (!rx.radio.init()) return 1;
+    rx.radio.available(); // start listening
+    rx.radio.carrier();
+
+    run_noise(noise_ms);
+    double noise_cycles = stats.cycles;
+    uint32_t noise_interrupts = stats.interrupts;
+    stats.interrupts = 0;
+
+    for (uint32_t f = 0; f < frames; f++) {
+        Sent* sent = &unread[unread_count++];
+        for (uint8_t i = 0; i < len; i++) sent->message[i] = lrand48();
+        sent->len = len;
+        sent->id = f;
+        sent->received = false;
+        // with -p nothing is read until the last one is in
+        run_frame(sent->message, len, f, per_read == 1);
+        if (unread_count == per_read || f + 1 == frames) {
+            check_received();
+            unread_count = 0;
+        }
+    }
+
+    double seconds = (stats.cycles - noise_cycles) / F_CPU;
+    uint32_t lost = frames - stats.received;
+    printf("%lu frames of %u bytes, %s receiver, RADIO_FEC_LEN %u\n",
+        (unsigned long)frames, len, RADIO_RX_CAPTURE ? "capture" : "PLL", RADIO_FEC_LEN);
+    printf("channel: ber %g, burst %g x %u bits, skew %g, dropout %g x %u bits\n",
+        channel.ber, channel.burst_chance, channel.burst_bits, channel.skew,
+        channel.dropout_chance, channel.dropout_bits);
+    printf("received %lu, lost %lu, corrupt %lu\n",
+        (unsigned long)stats.received, (unsigned long)lost, (unsigned long)stats.corrupt);
+    printf("frame error rate %.2f%%\n", frames ? 100.0 * lost / frames : 0.0);
+    if (per_read > 1) {
+        printf("read every %lu frames, RADIO_RX_SLOTS %u\n", (unsigned long)per_read, RADIO_RX_SLOTS);
+    }
+    printf("throughput %.0f bps of message data (%d bps on air)\n",
+        stats.received * len * 8 / seconds, RADIO_SPEED);
+    printf("receiver interrupts %.0f per frame\n", frames ? (double)stats.interrupts / frames : 0.0);
+    printf("carrier sensed on %lu frames\n", (unsigned long)stats.sensed);
+    if (noise_ms) {
+        printf("noise: %lu ms, carrier sensed in %lu, %.0f receiver interrupts per ms\n",
+            (unsigned long)noise_ms, (unsigned long)stats.noise_sensed,
+            (double)noise_interrupts / noise_ms);
+    }
+    return 0;
+}
@@ -0,0 +1,3 @@
+#include <avr/io.h>
+
+sim_registers sim_regs;
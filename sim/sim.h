@@ -0,0 +1,66 @@
+/**
+ * Shared state of the host simulators
+ * The virtual bootloader runs program.cpp against an in-memory
+ * flash (flash_sim.cpp) and a scripted programmer on the other end
+ * of the radio (radio_script.cpp), both on a simulated clock.
+ */
+
+#pragma once
+
+#include <avr/io.h>
+#include <stdint.h>
+#include "radio.h"
+
+// simulated time, moved on by radio airtime and flash operations
+extern uint64_t sim_us;
+
+// flash model, the whole 32KB with per page wear counters, and the EEPROM
+#define SIM_FLASH_SIZE (FLASHEND + 1)
+#define SIM_FLASH_PAGES (SIM_FLASH_SIZE / SPM_PAGESIZE)
+
+struct SimFlashStats {
+    uint32_t erases;
+    uint32_t writes;
+    uint32_t skipped; // flash already held the page
+    uint32_t rww_reads; // application section read while SPM was busy
+    uint64_t stall_us; // spent in flash_wait()
+    uint32_t eeprom_writes; // bytes that changed
+    uint32_t eeprom_spm_clashes; // EEPROM written while SPM was busy
+    uint16_t page_writes[SIM_FLASH_PAGES];
+};
+
+extern uint8_t sim_flash[SIM_FLASH_SIZE];
+extern uint8_t sim_eeprom[E2END + 1];
+extern SimFlashStats sim_flash_stats;
+// chance that a page write leaves one bit wrong
+extern double sim_flash_fault;
+void sim_flash_reset(void);
+
+// programmer on the other end of the radio, sends frames with the
+// same sliding window as the bridge and program.py
+struct SimFrame {
+    uint8_t len;
+    uint8_t data[RADIO_MAX_MESSAGE_LEN];
+};
+
+struct SimLinkStats {
+    uint32_t sent;
+    uint32_t lost; // on the air, either direction
+    uint32_t overruns; // every receive slot was full
+    uint32_t timeouts;
+    bool done; // DNE came back
+    bool up_to_date; // UTD instead
+    bool rejected; // BAD, the image failed verification
+    uint16_t repaired_pages; // sent again, an ACK named them as failed
+    bool bad_page; // one failed again after that, the update was given up
+    uint32_t polls; // FRAME_POLL answered, fleet updates only
+    uint8_t repair_rounds; // broadcasts after the first one
+};
+
+extern SimLinkStats sim_link_stats;
+void sim_link_start(const SimFrame* frames, uint16_t count, double loss);
+// the same frames as a fleet update (FLAG_MULTICAST in program.h),
+// like program_fleet() with the node as the only one in the fleet
+void sim_link_start_fleet(const SimFrame* frames, uint16_t count, double loss);
+// let the programmer transmit until the given time
+void sim_link_run_until(uint64_t us);
@@ -0,0 +1,379 @@
+/**
+ * End to end run of the real waveboot.elf on simavr
+ * The bootloader runs from BOOT_START like with the BOOTRST fuse set.
+ * A programmer on the host, the radio code from src/radio.cpp built
+ * against sim/avr/io.h, is wired to RADIO_TX_PIN and RADIO_RX_PIN
+ * (ICP1 with NODE_RX_CAPTURE). It sends BOOT until it hears RDY, then
+ * replays the image with the same sliding window as the bridge.
+ * Prints one JSON object: the update time, interrupts serviced with
+ * the worst cycles per vector (vector to reti), the stack high-water
+ * mark below the ELF's __stack and the bytes written with SPM.
+ *
+ * Usage: simavr_e2e waveboot.elf image.hex
+ */
+
+#include "radio.h"
+#include "config.h"
+#include "program.h"
+#include "image.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gelf.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "avr_ioport.h"
+
+#ifndef NODE_RX_CAPTURE
+#define NODE_RX_CAPTURE 0
+#endif
+
+#define SAMPLE_CYCLES (F_CPU / RADIO_SPEED / RADIO_RX_SAMPLES_PER_BIT)
+#define MS_CYCLES (F_CPU / 1000)
+#define BOOT_RETRY_MS 300
+#define ACK_TIMEOUT_MS 400 // same as the bridge
+#define SEND_ATTEMPTS 6
+#define LIMIT_MS 600000 // give up on the whole update
+
+// atmega328p
+#define VECTOR_COUNT 26
+#define VECTOR_BYTES 4
+#define DATA_MCUCR 0x55
+#define DATA_SPMCSR 0x57
+#define OP_RETI 0x9518
+#define OP_SPM 0x95E8
+#define SPM_PAGE_WRITE 0x05 // PGWRT | SELFPRGEN
+
+static const char* const vector_names[VECTOR_COUNT] = {
+    "RESET", "INT0", "INT1", "PCINT0", "PCINT1", "PCINT2", "WDT",
+    "TIMER2_COMPA", "TIMER2_COMPB", "TIMER2_OVF", "TIMER1_CAPT",
+    "TIMER1_COMPA", "TIMER1_COMPB", "TIMER1_OVF", "TIMER0_COMPA",
+    "TIMER0_COMPB", "TIMER0_OVF", "SPI_STC", "USART_RX", "USART_UDRE",
+    "USART_TX", "ADC", "EE_READY", "ANALOG_COMP", "TWI", "SPM_READY"
+};
+
+enum Phase {
+    BOOTING,
+    PROGRAMMING,
+    FINISHED
+};
+
+static avr_t* avr;
+static avr_irq_t* node_rx;
+static Radio programmer;
+static SimFrame frames[SIM_MAX_FRAMES];
+static uint16_t frame_count;
+
+static struct {
+    Phase phase;
+    bool done; // DNE came back
+    int32_t isr_ticks; // from a RADIO_PROFILE node's DNE, -1 without
+    uint8_t tx_phase; // samples into the current transmitted bit
+    bool line; // level on the node's receiver
+    uint64_t next_boot;
+    uint64_t started; // first BOOT
+    uint64_t ready; // RDY heard
+    uint64_t finished;
+    uint16_t base;
+    uint8_t acked;
+    uint8_t burst_pos;
+    bool waiting;
+    uint64_t deadline; // 0 until the ACK request is out
+    uint8_t attempts;
+    uint32_t sent;
+    uint32_t timeouts;
+} link;
+
+static struct {
+    uint32_t count[VECTOR_COUNT];
+    uint64_t max_cycles[VECTOR_COUNT];
+    // nesting, waveboot never re-enables interrupts in an ISR
+    uint8_t running[4];
+    uint64_t entered[4];
+    uint8_t depth;
+    uint16_t stack_top; // __stack, where SP starts
+    uint16_t min_sp;
+    uint32_t bytes_written;
+} stats;
+
+// value of a symbol in the ELF, or fallback when it has none
+static uint32_t elf_symbol(const char* path, const char* name, uint32_t fallback) {
+    uint32_t value = fallback;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return fallback;
+    elf_version(EV_CURRENT);
+    Elf* elf = elf_begin(fd, ELF_C_READ, NULL);
+
+    Elf_Scn* section = NULL;
+    while (elf && (section = elf_nextscn(elf, section))) {
+        GElf_Shdr header;
+        if (!gelf_getshdr(section, &header) || header.sh_type != SHT_SYMTAB) continue;
+        Elf_Data* data = elf_getdata(section, NULL);
+        for (size_t i = 0; data && i < header.sh_size / header.sh_entsize; i++) {
+            GElf_Sym symbol;
+            if (!gelf_getsym(data, i, &symbol)) continue;
+            const char* symbol_name = elf_strptr(elf, header.sh_link, symbol.st_name);
+            if (symbol_name && strcmp(symbol_name, name) == 0) value = symbol.st_value;
+        }
+    }
+
+    if (elf) elf_end(elf);
+    close(fd);
+    return value;
+}
+
+static uint8_t window_len() {
+    uint16_t left = frame_count - link.base;
+    return left < WINDOW_SIZE ? left : WINDOW_SIZE;
+}
+
+static bool next_unacked(uint8_t* pos) {
+    for (; *pos < window_len(); (*pos)++) {
+        if (!(link.acked & (1 << *pos))) return true;
+    }
+    return false;
+}
+
+static void finish(bool done) {
+    link.phase = FINISHED;
+    link.done = done;
+    link.finished = avr->cycle;
+}
+
+static void programmer_receive(const uint8_t* message, uint8_t len) {
+    if (link.phase == BOOTING) {
+        if (len >= 3 && memcmp(message, "RDY", 3) == 0) {
+            link.phase = PROGRAMMING;
+            link.ready = avr->cycle;
+        }
+        return;
+    }
+
+    if (len >= 3 && memcmp(message, "DNE", 3) == 0) {
+        if (len >= 5) link.isr_ticks = message[3] | (message[4] << 8);
+        finish(true);
+        return;
+    }
+    if (len < 5 || memcmp(message, "ACK", 3) != 0) return;
+
+    uint8_t done = message[3] - (uint8_t)link.base;
+    if (done > window_len()) return; // stale
+    if (done) link.attempts = 0;
+    link.base += done;
+    link.acked = message[4];
+    link.burst_pos = 0;
+    link.waiting = false;
+}
+
+static void programmer_send() {
+    uint64_t now = avr->cycle;
+
+    if (link.phase == BOOTING) {
+        if (now < link.next_boot) return;
+        if (!link.started) link.started = now;
+        programmer.setHeaderId(0);
+        programmer.setHeaderFlags(0);
+        programmer.send((const uint8_t*)"BOOT", 4);
+        link.next_boot = now + BOOT_RETRY_MS * MS_CYCLES;
+        return;
+    }
+
+    if (link.waiting) {
+        // the timeout starts once the ACK request is out
+        if (!link.deadline) link.deadline = now + ACK_TIMEOUT_MS * MS_CYCLES;
+        if (now < link.deadline) return;
+        link.waiting = false;
+        link.burst_pos = 0;
+        link.timeouts++;
+        if (++link.attempts >= SEND_ATTEMPTS) {
+            finish(false);
+            return;
+        }
+    }
+
+    if (!next_unacked(&link.burst_pos)) return;
+
+    uint16_t index = link.base + link.burst_pos++;
+    uint8_t pos = link.burst_pos;
+    bool last = !next_unacked(&pos);
+    programmer.setHeaderId(index);
+    programmer.setHeaderFlags(last ? FLAG_ACK_REQUEST : 0);
+    programmer.send(frames[index].data, frames[index].len);
+    link.sent++;
+    if (last) {
+        link.waiting = true;
+        link.deadline = 0;
+    }
+}
+
+// the programmer's timer1, RADIO_RX_SAMPLES_PER_BIT times per bit
+static avr_cycle_count_t programmer_tick(avr_t* avr, avr_cycle_count_t when, void* param) {
+    if (programmer.sending()) {
+        if (++link.tx_phase == RADIO_RX_SAMPLES_PER_BIT) {
+            link.tx_phase = 0;
+            programmer.handle_timer_interrupt();
+        }
+    } else {
+        link.tx_phase = RADIO_RX_SAMPLES_PER_BIT - 1; // first bit goes out right away
+        programmer.handle_timer_interrupt();
+    }
+
+    bool level = PORTD & (1 << RADIO_TX_PIN);
+    if (level != link.line) {
+        link.line = level;
+        avr_raise_irq(node_rx, level);
+    }
+
+    if (link.phase != FINISHED && !programmer.sending()) {
+        const uint8_t* message;
+        uint8_t len;
+        if (programmer.recv_view(&message, &len)) {
+            programmer_receive(message, len);
+            programmer.release();
+        }
+        if (link.phase != FINISHED) programmer_send();
+    }
+
+    return when + SAMPLE_CYCLES;
+}
+
+// the node's transmitter drives the programmer's receiver
+static void node_tx_changed(avr_irq_t* irq, uint32_t value, void* param) {
+    if (value) {
+        PIND |= (1 << RADIO_RX_PIN);
+    } else {
+        PIND &= ~(1 << RADIO_RX_PIN);
+    }
+}
+
+// the interrupt vector table in use, IVSEL in MCUCR moves it to BOOT_START
+static uint32_t vector_table() {
+    return avr->data[DATA_MCUCR] & (1 << 1) ? BOOT_START : 0;
+}
+
+// simavr has no IVSEL, its interrupts always land in the application's
+// table, move them to the boot section's like the chip does
+static void redirect_vectors() {
+    uint32_t table = vector_table();
+    if (table && avr->pc > 0 && avr->pc < VECTOR_COUNT * VECTOR_BYTES) avr->pc += table;
+}
+
+static void track_interrupts(uint16_t opcode) {
+    uint32_t table = vector_table();
+
+    if (opcode == OP_RETI && stats.depth) {
+        stats.depth--;
+        uint8_t vector = stats.running[stats.depth];
+        uint64_t cycles = avr->cycle - stats.entered[stats.depth];
+        if (cycles > stats.max_cycles[vector]) stats.max_cycles[vector] = cycles;
+    }
+
+    // the vector itself is only ever reached by an interrupt, RESET aside
+    if (avr->pc > table && avr->pc < table + VECTOR_COUNT * VECTOR_BYTES) {
+        uint8_t vector = (avr->pc - table) / VECTOR_BYTES;
+        stats.count[vector]++;
+        if (stats.depth < sizeof(stats.running)) {
+            stats.running[stats.depth] = vector;
+            stats.entered[stats.depth] = avr->cycle;
+            stats.depth++;
+        }
+    }
+}
+
+static void print_json(const char* image, uint16_t mismatches, int state) {
+    uint32_t total = 0;
+    for (uint8_t v = 0; v < VECTOR_COUNT; v++) total += stats.count[v];
+
+    printf("{\n");
+    printf("  \"image\": \"%s\",\n", image);
+    printf("  \"ok\": %s,\n", link.done && !mismatches ? "true" : "false");
+    if (state == cpu_Crashed) printf("  \"error\": \"crashed at 0x%04x\",\n", (unsigned)avr->pc);
+    else if (link.phase != FINISHED) printf("  \"error\": \"timeout\",\n");
+    printf("  \"update_s\": %.3f,\n", link.finished > link.started ? (double)(link.finished - link.started) / F_CPU : 0.0);
+    printf("  \"programming_s\": %.3f,\n", link.finished > link.ready && link.ready ? (double)(link.finished - link.ready) / F_CPU : 0.0);
+    printf("  \"frames\": %u,\n", frame_count);
+    printf("  \"frames_sent\": %lu,\n", (unsigned long)link.sent);
+    printf("  \"ack_timeouts\": %lu,\n", (unsigned long)link.timeouts);
+    printf("  \"mismatched_pages\": %u,\n", mismatches);
+    printf("  \"bytes_written\": %lu,\n", (unsigned long)stats.bytes_written);
+    printf("  \"stack_bytes\": %u,\n", stats.min_sp ? stats.stack_top - stats.min_sp : 0);
+    // timer1 ticks, cycles without RADIO_RX_CAPTURE, compare with max_cycles
+    if (link.isr_ticks >= 0) printf("  \"node_isr_ticks_max\": %ld,\n", (long)link.isr_ticks);
+    printf("  \"interrupts\": %lu,\n", (unsigned long)total);
+    printf("  \"isr\": {");
+    const char* separator = "\n";
+    for (uint8_t v = 0; v < VECTOR_COUNT; v++) {
+        if (!stats.count[v]) continue;
+        printf("%s    \"%s\": { \"count\": %lu, \"max_cycles\": %llu }", separator, vector_names[v],
+            (unsigned long)stats.count[v], (unsigned long long)stats.max_cycles[v]);
+        separator = ",\n";
+    }
+    printf("\n  }\n");
+    printf("}\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s waveboot.elf image.hex\n", argv[0]);
+        return 2;
+    }
+
+    elf_firmware_t firmware;
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[1], &firmware) != 0) {
+        fprintf(stderr, "can't read %s\n", argv[1]);
+        return 1;
+    }
+    if (!sim_image_read_hex(argv[2])) {
+        fprintf(stderr, "can't read %s\n", argv[2]);
+        return 1;
+    }
+    frame_count = sim_image_frames(frames, 0);
+    link.isr_ticks = -1;
+    // the Makefile moves it below RAMEND, data addresses may carry the 0x800000 offset
+    stats.stack_top = elf_symbol(argv[1], "__stack", RAMEND) & 0xFFFF;
+
+    avr = avr_make_mcu_by_name("atmega328p");
+    if (!avr) return 1;
+    avr_init(avr);
+    avr->frequency = F_CPU;
+    avr_load_firmware(avr, &firmware);
+    // BOOTRST, start in the boot section
+    avr->reset_pc = BOOT_START;
+    avr->pc = BOOT_START;
+
+#if NODE_RX_CAPTURE
+    node_rx = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0); // ICP1
+#else
+    node_rx = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), RADIO_RX_PIN);
+#endif
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), RADIO_TX_PIN), node_tx_changed, NULL);
+    avr_raise_irq(node_rx, 0);
+
+    programmer.init();
+    programmer.available(); // start listening
+    avr_cycle_timer_register(avr, SAMPLE_CYCLES, programmer_tick, NULL);
+
+    int state = cpu_Running;
+    uint64_t limit = (uint64_t)LIMIT_MS * MS_CYCLES;
+    while (link.phase != FINISHED && avr->cycle < limit) {
+        uint16_t opcode = avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8);
+        if (opcode == OP_SPM && (avr->data[DATA_SPMCSR] & SPM_PAGE_WRITE) == SPM_PAGE_WRITE) {
+            stats.bytes_written += SPM_PAGESIZE;
+        }
+
+        state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed) break;
+        redirect_vectors();
+
+        uint16_t sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+        if (!stats.min_sp || sp < stats.min_sp) stats.min_sp = sp;
+        track_interrupts(opcode);
+    }
+
+    uint16_t mismatches = sim_image_mismatches(avr->flash);
+    print_json(argv[2], mismatches, state);
+    return link.done && !mismatches ? 0 : 1;
+}
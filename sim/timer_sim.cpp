@@ -0,0 +1,17 @@
+// timer.h on the simulated clock
+
+#include "timer.h"
+#include "sim.h"
+
+uint64_t sim_us = 0;
+
+void timer_init(void) {}
+
+uint32_t millis(void) {
+    return sim_us / 1000;
+}
+
+void delay(uint32_t ms) {
+    sim_link_run_until(sim_us + ms * 1000);
+    sim_us += ms * 1000;
+}
@@ -1,12 +1,27 @@
 #include <avr/io.h>
 
-#define BOOT_TIMEOUT_MS 4000 // 4s - timeout for bootloader to receive BOOT
+#define BOOT_TIMEOUT_MS 4000 // 4s - timeout for bootloader to receive BOOT after the application asked for it
+#define BOOT_FALLBACK_MS 300 // listen window on any other reset, 0 goes straight to the application
+#define BOOT_QUIET_MS 250 // the BOOT_FALLBACK_MS window closes early after this long without a transmitter on the air, 0 disables
+#define BOOT_HOLD_MS 2000 // a transmitter on the air keeps a listen window open, up to this long past its timeout
 #define PROGRAMMING_TIMEOUT_MS 10000 // 10s - timeout for programming
+#define FINISHED_LINGER_MS 1500 // a node done with an update answers FRAME_END again until this long passes without one, longer than the programmer waits for the answer
 // #define BOOT_TIMEOUT_MS 15000 // 15s
 #define BOOTSIZE 4096 // 4KB (if BOOT fuses are changed, this must be changed)
-#define BOOT_START ((uint32_t)FLASHEND + 1) - BOOTSIZE
+#define BOOT_START (((uint32_t)FLASHEND + 1) - BOOTSIZE)
 #define F_CPU 16000000UL // 16MHz (if clock fuses are changed, this must be changed)
 
+// handoff from the application, it writes BOOT_REQUEST_MAGIC here
+// and resets with the watchdog (see example/main.ino), the bootloader's
+// stack starts below it (__stack in the Makefile)
+#define BOOT_REQUEST_ADDR (RAMEND - 1) // 2 bytes at the top of RAM
+#define BOOT_REQUEST_MAGIC 0xB007
+
+// radio address of the node, for fleet updates (see FLAG_MULTICAST in
+// program.h), 1 to 254, erased (0xFF) leaves it at DEFAULT_ADDRESS
+// it's the byte just below the ones program.cpp keeps in EEPROM
+#define NODE_ADDRESS_ADDR ((uint8_t*)(E2END - 12))
+
 // onboard status LED
 #define LED_PIN PB5
 #define SET_LED DDRB |= (1 << LED_PIN)
@@ -17,5 +32,5 @@
 #define RADIO_DDR DDRD
 #define RADIO_PORT PORTD
 #define RADIO_PIN PIND
-#define RADIO_RX_PIN PD6
+#define RADIO_RX_PIN PD6 // unused with RADIO_RX_CAPTURE=1, receiver is on ICP1 (PB0)
 #define RADIO_TX_PIN PD5
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "flash.h"
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+
+enum FlashState {
+    FLASH_IDLE,
+    FLASH_ERASING,
+    FLASH_ERASING_ONLY,
+    FLASH_WRITING,
+    FLASH_ENABLING_RWW
+};
+
+static volatile uint8_t flash_state = FLASH_IDLE;
+static uint16_t flash_page_address;
+// the page written last is read back against this CRC-CCITT
+static bool flash_verify_pending = false;
+static uint16_t flash_verify_crc;
+static uint8_t flash_failed = 0;
+static uint16_t flash_failed_address = 0xFFFF;
+
+// start an SPM operation (avr/boot.h command) with the ready interrupt enabled
+// SPMIE has to go out with the command, SPMCSR is written whole
+// and spm must follow within 4 cycles, so interrupts must be off
+static inline void spm_start(uint16_t address, uint8_t command) {
+    __asm__ __volatile__ (
+        "out %0, %1\n\t"
+        "spm\n\t"
+        :
+        :   "I" (_SFR_IO_ADDR(SPMCSR)),
+            "r" ((uint8_t)(command | (1 << SPMIE))),
+            "z" (address)
+    );
+}
+
+void flash_write_page(uint16_t page_address, const uint8_t* data) {
+    // one page at a time, and SPM can't start while EEPROM is written
+    flash_wait();
+
+    // SPM costs ~9ms and wears the page, most of a rebuild is the
+    // same code, and programming alone can only clear bits
+    bool same = true;
+    bool needs_erase = false;
+    for (uint8_t i = 0; i < SPM_PAGESIZE; i++) {
+        uint8_t old = pgm_read_byte_near(page_address + i);
+        if (old != data[i]) same = false;
+        if ((old & data[i]) != data[i]) needs_erase = true;
+    }
+    if (same) return;
+
+    eeprom_busy_wait();
+
+    // datasheet alternative 1: the temporary buffer survives the
+    // erase, so fill it first and the caller's buffer is free again
+    // atmega328p is little-endian
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < SPM_PAGESIZE; i += 2) {
+        uint16_t word = data[i] | (data[i + 1] << 8);
+        crc = _crc_ccitt_update(crc, data[i]);
+        crc = _crc_ccitt_update(crc, data[i + 1]);
+        cli();
+        boot_page_fill(page_address + i, word);
+        sei();
+    }
+
+    cli();
+    flash_page_address = page_address;
+    flash_verify_crc = crc;
+    flash_verify_pending = true;
+    if (needs_erase) {
+        flash_state = FLASH_ERASING;
+        spm_start(page_address, __BOOT_PAGE_ERASE);
+    } else {
+        flash_state = FLASH_WRITING;
+        spm_start(page_address, __BOOT_PAGE_WRITE);
+    }
+    sei();
+}
+
+void flash_erase_page(uint16_t page_address) {
+    flash_wait();
+    eeprom_busy_wait();
+
+    cli();
+    flash_state = FLASH_ERASING_ONLY;
+    spm_start(page_address, __BOOT_PAGE_ERASE);
+    sei();
+}
+
+bool flash_busy(void) {
+    return flash_state != FLASH_IDLE;
+}
+
+void flash_wait(void) {
+    while (flash_busy());
+
+    // read the page back once it's readable again, a worn or
+    // brownout hit page doesn't take the bits
+    if (!flash_verify_pending) return;
+    flash_verify_pending = false;
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < SPM_PAGESIZE; i++) {
+        crc = _crc_ccitt_update(crc, pgm_read_byte_near(flash_page_address + i));
+    }
+    if (crc != flash_verify_crc) {
+        if (flash_failed != 0xFF) flash_failed++;
+        flash_failed_address = flash_page_address;
+    }
+}
+
+uint8_t flash_failed_pages(void) {
+    return flash_failed;
+}
+
+uint16_t flash_failed_page(void) {
+    return flash_failed_address;
+}
+
+// level triggered, fires whenever SPMEN is clear and SPMIE is set
+ISR(SPM_READY_vect) {
+    switch (flash_state) {
+        case FLASH_ERASING:
+            flash_state = FLASH_WRITING;
+            spm_start(flash_page_address, __BOOT_PAGE_WRITE);
+            break;
+        case FLASH_ERASING_ONLY:
+        case FLASH_WRITING:
+            // re-enable reading the application section
+            flash_state = FLASH_ENABLING_RWW;
+            spm_start(0, __BOOT_RWW_ENABLE);
+            break;
+        default:
+            flash_state = FLASH_IDLE;
+            SPMCSR = 0; // SPMIE off
+            break;
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+
+// page programming that doesn't stall the radio
+// the page is copied into the SPM temporary buffer right away, then
+// the erase and the write run in the background, each step started
+// from SPM_READY_vect with interrupts left on
+// the application section (RWW) reads as garbage until flash_wait()
+// returns, the bootloader itself (NRWW) keeps running
+// a page that already holds the data isn't touched, one that only
+// needs bits cleared (1 -> 0) is written without the erase, and a
+// page that was written is read back once it's done
+
+void flash_write_page(uint16_t page_address, const uint8_t* data);
+// erase only, the page reads as 0xFF afterwards
+void flash_erase_page(uint16_t page_address);
+bool flash_busy(void);
+// returns once nothing is in flight, call it before reading the
+// application section
+void flash_wait(void);
+// pages that didn't read back as written since boot, saturates at 255
+// the page in flight counts once flash_wait() has returned
+uint8_t flash_failed_pages(void);
+// address of the last of them, 0xFFFF while there are none
+uint16_t flash_failed_page(void);
@@ -0,0 +1,89 @@
+#include "led.h"
+#include "config.h"
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+
+// durations in 10ms steps, alternating on/off starting with on
+// 0 ends the pattern
+static const uint8_t PROGMEM pattern_ack[] = { 5, 5, 0 };
+static const uint8_t PROGMEM pattern_ready[] = { 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 0 };
+static const uint8_t PROGMEM pattern_error[] = { 20, 20, 20, 20, 20, 20, 0 };
+static const uint8_t PROGMEM pattern_recovery[] = { 10, 90, 0 };
+
+static const uint8_t* const PROGMEM patterns[] = {
+    pattern_ack,
+    pattern_ready,
+    pattern_error,
+    pattern_recovery
+};
+
+static volatile uint8_t queue[LED_QUEUE_LEN];
+static volatile uint8_t queue_head = 0;
+static volatile uint8_t queue_tail = 0;
+static volatile uint8_t queue_count = 0;
+static uint8_t current = 0xFF;
+static const uint8_t* step = 0; // next duration, 0 when not playing
+static uint16_t remaining_ms = 0;
+static bool lit = false;
+static bool steady = false;
+
+// start the next step, pattern or rest at the steady level
+static void advance(void) {
+    uint8_t duration = step ? pgm_read_byte(step) : 0;
+
+    if (!duration) {
+        if (queue_count) {
+            current = queue[queue_tail];
+            queue_tail = (queue_tail + 1) % LED_QUEUE_LEN;
+            queue_count--;
+        } else if (current != LED_RECOVERY) {
+            current = 0xFF;
+            step = 0;
+            if (steady) LED_ON; else LED_OFF;
+            return;
+        }
+
+        step = (const uint8_t*)pgm_read_ptr(&patterns[current]);
+        lit = false;
+        duration = pgm_read_byte(step);
+    }
+
+    lit = !lit;
+    if (lit) LED_ON; else LED_OFF;
+    remaining_ms = duration * 10;
+    step++;
+}
+
+void led_on(void) {
+    cli();
+    steady = true;
+    if (!step) LED_ON;
+    sei();
+}
+
+void led_off(void) {
+    cli();
+    steady = false;
+    if (!step) LED_OFF;
+    sei();
+}
+
+void led_play(uint8_t pattern) {
+    cli();
+    if (queue_count < LED_QUEUE_LEN) {
+        queue[queue_head] = pattern;
+        queue_head = (queue_head + 1) % LED_QUEUE_LEN;
+        queue_count++;
+    }
+    // start right away if nothing is playing, otherwise it's next
+    // once the current pattern ends (a repeating one gives way at the
+    // end of its cycle, see advance())
+    if (!step) advance();
+    sei();
+}
+
+// called every 1ms from the timer0 interrupt
+void led_tick(void) {
+    if (!step || --remaining_ms) return;
+    advance();
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+
+// status LED patterns, played from the 1ms timer tick so status
+// never blocks the radio or the programming loop
+// patterns are queued and played in order, between patterns the
+// LED sits at the level set with led_on()/led_off()
+#define LED_ACK 0 // short blink, a window was acknowledged
+#define LED_READY 1 // five short blinks, BOOT received
+#define LED_ERROR 2 // three long blinks, a frame was rejected
+#define LED_RECOVERY 3 // slow blink, repeats until another pattern is queued
+#define LED_QUEUE_LEN 4 // patterns queued past this are dropped
+
+void led_on(void);
+void led_off(void);
+void led_play(uint8_t pattern);
+void led_tick(void);
@@ -0,0 +1,37 @@
+#include "lz.h"
+#include <avr/io.h>
+
+// unpacks a compressed chunk into the page buffer at offset
+// back references point into bytes of the page already unpacked,
+// so there is no window to keep besides the page itself
+// returns false if the chunk would read or write outside the page
+bool lz_unpack(uint8_t* page, uint16_t offset, const uint8_t* src, uint8_t len) {
+    const uint8_t* end = src + len;
+
+    while (src != end) {
+        uint8_t token = *src++;
+        uint8_t count = (token & 0x7F) + 1;
+
+        if (token & 0x80) {
+            // match: <token><distance - 1>
+            if (src == end) return false;
+            uint16_t distance = *src++ + 1;
+            count += LZ_MIN_MATCH - 1;
+            if (distance > offset || offset + count > SPM_PAGESIZE) return false;
+
+            // byte by byte on purpose, overlapping copies repeat patterns
+            for (; count != 0; --count, ++offset) {
+                page[offset] = page[offset - distance];
+            }
+        } else {
+            // literal run: <token><count bytes>
+            if (count > end - src || offset + count > SPM_PAGESIZE) return false;
+
+            for (; count != 0; --count, ++offset) {
+                page[offset] = *src++;
+            }
+        }
+    }
+
+    return true;
+}
\ No newline at end of file
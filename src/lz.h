@@ -0,0 +1,7 @@
+#pragma once
+#include <stdint.h>
+
+// see programmer/lz.py for the stream format
+#define LZ_MIN_MATCH 3
+
+bool lz_unpack(uint8_t* page, uint16_t offset, const uint8_t* src, uint8_t len);
\ No newline at end of file
@@ -2,161 +2,354 @@
 #include "config.h"
 #include "timer.h"
 #include "radio.h"
-#include <avr/boot.h>
+#include "lz.h"
+#include "flash.h"
+#include "led.h"
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
+#include <string.h>
+
+// update state, one byte in EEPROM so setting and clearing it never
+// costs a page erase/write, applications must leave the last 12
+// bytes of EEPROM alone (13 with NODE_ADDRESS_ADDR)
+#define UPDATE_STATE_ADDR ((uint8_t*)E2END)
+#define UPDATE_IDLE 0xFF // erased, nothing known about the image in flash
+#define UPDATE_RUNNING 0xA5 // flash is being written, don't boot it
+#define UPDATE_VERIFIED 0x5A // flash matches INSTALLED_MANIFEST_ADDR
+// resume point, first uncommitted page of the image named by the id
+#define RESUME_PAGE_ADDR ((uint8_t*)(E2END - 1))
+#define RESUME_IMAGE_ADDR ((uint16_t*)(E2END - 3))
+// manifest of the image that passed verification
+#define INSTALLED_MANIFEST_ADDR ((uint8_t*)(E2END - 3 - MANIFEST_LEN))
+
+// when programming, we need to set the recovery marker
+// that way, if we crash, or if firmware lines stop being received,
+// we know the flash is corrupted and we shouldn't boot into it
+// in this state, the device will continously wait for BOOT so 
+// it can write a new firmware
+// a torn EEPROM write leaves none of the states, which is fine
+// both ways: it's set before the first page and cleared after
+// the last one
+static void set_update_state(uint8_t state) {
+    // EEPROM can't be written while SPM is busy, and the marker must
+    // not go before the last page is done
+    // only writes if the value changes, flash.cpp waits for it
+    // before the next SPM
+    flash_wait();
+    eeprom_update_byte(UPDATE_STATE_ADDR, state);
+}
 
-// the bootloader should never store code past FLASHEND - 3 bytes
-#define RECOVERY_BYTES_ADDR (FLASHEND - 3)  // 4 bytes at the end of application flash
-#define RECOVERY_BYTES 0xDEADBEEF
-
-static bool write_page(uint32_t page_address, const uint8_t* data, uint16_t len) {
-    // no safety, beforing running this function!!
-    // safety should be checked before calling this function!
-    // if (page_address >= BOOT_START) return false;
-
-    // disable interrupts when doing SPM operations
-    cli();
-
-    // erase page
-    boot_page_erase(page_address);
-    boot_spm_busy_wait();
-
-    // words are filled in word chunks (16 bits)
-    // atmega328p is little-endian
-    for (uint16_t i = 0; i < len; i += 2) {
-        uint16_t word;
-        if (i + 1 < len) {
-            word = data[i] | (data[i + 1] << 8);
-        } else {
-            // last odd byte, high byte = 0xFF
-            word = data[i] | (0xFF << 8);
-        }
-        boot_page_fill(page_address + i, word);
+bool check_recovery_bytes(void) {
+    return eeprom_read_byte(UPDATE_STATE_ADDR) == UPDATE_RUNNING;
+}
+
+// what RDY reports, nothing to resume unless an update was cut short
+void read_update_state(uint8_t* state) {
+    uint8_t update = eeprom_read_byte(UPDATE_STATE_ADDR);
+    eeprom_read_block(state, RESUME_IMAGE_ADDR, 2);
+    state[2] = update == UPDATE_RUNNING ? eeprom_read_byte(RESUME_PAGE_ADDR) : 0;
+    if (update == UPDATE_VERIFIED) {
+        eeprom_read_block(&state[3], INSTALLED_MANIFEST_ADDR + MANIFEST_LEN - 2, 2);
+    } else {
+        state[3] = state[4] = 0xFF;
     }
+}
 
-    boot_page_write(page_address);
-    boot_spm_busy_wait();
-
-    // re-enable flash execution
-    boot_rww_enable();
-    sei();
-
-    // idk if this is needed tbh
-    // uses extra clock cycles but it guarantees flash is not booted 
-    // into in a corrupted state
-    // just reads back each byte from flash and compare
-    // for (uint16_t i = 0; i < len; i++) {
-    //     uint8_t flash_b = pgm_read_byte_near((uint16_t)(page_address + i));
-    //     if (flash_b != data[i]) return false;
-    // }
-    return true;
+// RDY, with the largest frame we can take, so the programmer knows
+// how to split pages, where an update that was cut short can pick
+// up and the version it has
+void send_ready(Radio &driver) {
+    uint8_t ack[4 + UPDATE_STATE_LEN] = { 'R', 'D', 'Y', RADIO_MAX_MESSAGE_LEN };
+    read_update_state(&ack[4]);
+    driver.send(ack, sizeof(ack));
+    driver.wait_packet_send();
 }
 
-// when programming, we need to set the recovery bytes to 0xDEADBEEF
-// that way, if we crash, or if firmware lines stop being received,
-// we know the flash is corrupted and we shouldn't boot into it
-// in this state, the device will continously wait for BOOT so 
-// it can write a new firmware
-static void set_recovery_state(bool is_programming) {
-    uint32_t recovery_page_addr = RECOVERY_BYTES_ADDR & ~(SPM_PAGESIZE - 1);
-    uint16_t offset = RECOVERY_BYTES_ADDR - recovery_page_addr;
-    uint8_t page_buffer[SPM_PAGESIZE];
+// set before the first change to flash
+static void mark_update_running(bool has_manifest) {
+    set_update_state(UPDATE_RUNNING);
+    // an unnamed image, whatever progress was saved
+    // doesn't describe the flash anymore
+    if (!has_manifest) eeprom_update_byte(RESUME_PAGE_ADDR, 0);
+}
+
+// every page up to and including the last one handed to
+// flash_write_page() is in flash once it's done, except the failed
+// ones, the update resumes from the first of those
+static void save_resume_page(uint16_t written_page_addr, const uint8_t* failed) {
+    if (written_page_addr == 0xFFFF) return;
+    flash_wait();
+    uint8_t resume_page = written_page_addr / SPM_PAGESIZE + 1;
+    for (uint8_t page = 0; page < resume_page; page++) {
+        if (failed[page / 8] & (1 << (page % 8))) resume_page = page;
+    }
+    eeprom_update_byte(RESUME_PAGE_ADDR, resume_page);
+}
+
+// true if the page reads as erased, no need to erase it again
+static bool flash_page_blank(uint16_t page_addr) {
+    flash_wait();
 
-    // read current page into buffer
     for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
-        page_buffer[i] = pgm_read_byte_near((uint16_t)(recovery_page_addr + i));
+        if (pgm_read_byte_near(page_addr + i) != 0xFF) return false;
     }
+    return true;
+}
 
-    if (is_programming) {
-        // Set recovery bytes in little-endian format
-        page_buffer[offset + 0] = RECOVERY_BYTES & 0xFF;
-        page_buffer[offset + 1] = (RECOVERY_BYTES >> 8) & 0xFF;
-        page_buffer[offset + 2] = (RECOVERY_BYTES >> 16) & 0xFF;
-        page_buffer[offset + 3] = (RECOVERY_BYTES >> 24) & 0xFF;
-    } else {
-        page_buffer[offset + 0] = 0xFF;
-        page_buffer[offset + 1] = 0xFF;
-        page_buffer[offset + 2] = 0xFF;
-        page_buffer[offset + 3] = 0xFF;
+// IEEE CRC-32 of the application section up to len, a bit at a
+// time, it only runs once per update
+static uint32_t flash_crc32(uint16_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    flash_wait();
+
+    for (uint16_t i = 0; i < len; i++) {
+        crc ^= pgm_read_byte_near(i);
+        for (uint8_t bit = 8; bit != 0; --bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+// digest of each requested page so the programmer only sends pages that changed
+static void send_page_digests(Radio &driver, uint8_t first_page, uint8_t count) {
+    uint8_t reply[RADIO_MAX_MESSAGE_LEN] = { 'C', 'R', 'C', first_page };
+    uint8_t len = 4;
+
+    flash_wait();
+
+    for (uint8_t page = first_page; count != 0 && len + 2 <= RADIO_MAX_MESSAGE_LEN; page++, count--) {
+        uint16_t page_addr = (uint16_t)page * SPM_PAGESIZE;
+        if (page_addr >= BOOT_START) break;
+
+        uint16_t crc = 0xFFFF;
+        for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+            crc = Radio::updateCRC(crc, pgm_read_byte_near(page_addr + i));
+        }
+        reply[len++] = crc & 0xFF;
+        reply[len++] = crc >> 8;
     }
 
-    write_page(recovery_page_addr, page_buffer, SPM_PAGESIZE);
+    driver.send(reply, len);
+    driver.wait_packet_send();
 }
 
-bool check_recovery_bytes(void) {
-    uint32_t recovery_bytes = 0;
-    
-    // read 4 bytes
-    recovery_bytes |= (uint32_t)pgm_read_byte_near((uint16_t)(RECOVERY_BYTES_ADDR + 0));
-    recovery_bytes |= (uint32_t)pgm_read_byte_near((uint16_t)(RECOVERY_BYTES_ADDR + 1)) << 8;
-    recovery_bytes |= (uint32_t)pgm_read_byte_near((uint16_t)(RECOVERY_BYTES_ADDR + 2)) << 16;
-    recovery_bytes |= (uint32_t)pgm_read_byte_near((uint16_t)(RECOVERY_BYTES_ADDR + 3)) << 24;
-    
-    return recovery_bytes == RECOVERY_BYTES;
+// a page that didn't read back as written is failed until it's sent
+// again, and a fleet page missing again, the next poll gets it sent
+// seen is how many were caught, a page is verified by the next
+// flash_wait(), so checking after each call that waits misses none
+static void mark_failed_page(uint8_t* failed, uint8_t* missing, uint8_t* seen) {
+    if (flash_failed_pages() == *seen) return;
+    *seen = flash_failed_pages();
+    uint8_t page = flash_failed_page() / SPM_PAGESIZE;
+    failed[page / 8] |= 1 << (page % 8);
+    missing[page / 8] |= 1 << (page % 8);
+}
+
+// bytes of a page bitmap up to the last one with a bit set, 0 if none are
+static uint8_t bitmap_len(const uint8_t* pages) {
+    uint8_t len = POLL_BITMAP_LEN;
+    while (len && !pages[len - 1]) len--;
+    return len;
+}
+
+// what a fleet update still needs from this node, see FRAME_POLL
+static void send_missing_pages(Radio &driver, uint8_t status, const uint8_t* missing) {
+    uint8_t reply[4 + POLL_BITMAP_LEN] = { 'N', 'A', 'K', status };
+    memcpy(&reply[4], missing, POLL_BITMAP_LEN);
+    driver.send(reply, sizeof(reply));
+    driver.wait_packet_send();
+}
+
+// DNE, UTD or BAD, see FRAME_BEGIN
+static void send_result(Radio &driver, const char* result) {
+#if RADIO_PROFILE
+    uint16_t ticks = Radio::isrTicksMax();
+    uint8_t reply[5] = { (uint8_t)result[0], (uint8_t)result[1], (uint8_t)result[2],
+        (uint8_t)ticks, (uint8_t)(ticks >> 8) };
+    driver.send(reply, sizeof(reply));
+#else
+    driver.send((const uint8_t*)result, 3);
+#endif
+    driver.wait_packet_send();
 }
 
 bool program_flash(Radio &driver) {
-    uint8_t buffer[BUFFER_SIZE];
+    // frames that arrived ahead of the next expected one
+    // slot = id % WINDOW_SIZE
+    // static so it's in .bss, where the linker counts it against RAM,
+    // the stack only gets checked at run time
+    static uint8_t window[WINDOW_SIZE][BUFFER_SIZE];
+    uint8_t window_len[WINDOW_SIZE];
+    uint8_t window_mask = 0; // bit i: frame next_id + i is buffered
+    uint8_t next_id = 0;
     uint8_t page_buffer[SPM_PAGESIZE]; 
     uint16_t current_page_addr = 0xFFFF;
+    uint16_t written_page_addr = 0xFFFF; // last page handed to flash_write_page()
+    uint8_t unsaved_pages = 0; // written since the resume point was saved
     bool page_dirty = false;
     bool is_flash_modified = false;
+    bool has_manifest = false; // FRAME_BEGIN described the image
+    uint8_t manifest[MANIFEST_LEN];
     uint32_t last_update_time = millis();
+    // fleet update (FLAG_MULTICAST), pages come in any order and only
+    // complete ones are written
+    bool multicast = false;
+    bool up_to_date = false; // BEGIN named the installed image
+    uint8_t missing[POLL_BITMAP_LEN]; // bit per page, set until it's in flash
+    uint8_t page_parts = 0; // frames of the current page that are in
+    uint8_t page_last = 0xFF; // index of its FLAG_PAGE_END frame
+    uint8_t failed[POLL_BITMAP_LEN]; // bit per page, set while it's failed
+    uint8_t failed_seen = flash_failed_pages(); // failed pages marked in failed and missing
+    // update over, what FRAME_END (or FRAME_BEGIN) was answered with,
+    // it's answered again until FINISHED_LINGER_MS pass without a word
+    const char* finished = NULL;
+    uint32_t finished_time = 0;
+    memset(missing, 0xFF, sizeof(missing));
+    memset(failed, 0, sizeof(failed));
 
     /** 
      * TODO: 
      * extra feature
      * rst, boot, updated fail (modified flash) + EEPROM backup -> write EEPROM backup to flash + jump to application */ 
 
-    LED_ON; // LED ON initially
+    led_on(); // LED ON while programming
 
     while (true) {
-        uint8_t len = BUFFER_SIZE;
-        bool update_received = driver.recv(buffer, &len);
+        if (finished && millis() - finished_time > FINISHED_LINGER_MS) {
+            return finished[0] != 'B'; // BAD
+        }
+
         // check if update is still being received
         // if not, jump to application
-        if (!update_received) {
+        if (!driver.available()) {
             if (millis() - last_update_time > PROGRAMMING_TIMEOUT_MS) {
-                if (is_flash_modified) {
-                    return false;
-                } else {
-                    // no flash modification detected - jump to application
-                    // but still remove recovery bytes
-                    set_recovery_state(false);
-                    return false;
+                // the programmer can pick up from here
+                // pages of a fleet update aren't written in order
+                if (is_flash_modified && has_manifest && !multicast) {
+                    flash_wait();
+                    mark_failed_page(failed, missing, &failed_seen);
+                    save_resume_page(written_page_addr, failed);
                 }
+                // with nothing written the state is still right, an
+                // image cut short earlier stays in recovery
+                flash_wait();
+                return false;
             }
             continue;
         }
 
         last_update_time = millis();
 
-        LED_OFF;
-        delay(50);
+        uint8_t id = driver.headerId();
+        uint8_t flags = driver.headerFlags();
+        // fleet frames skip the window, they go next, and the id
+        // is the frame's place in its page
+        // only this one is processed below, nothing is held past
+        // a missing frame without the window
+        uint8_t part = id;
+        if (flags & FLAG_MULTICAST) {
+            multicast = true;
+            id = next_id;
+        }
+        uint8_t ahead = id - next_id; // wraps, old frames land >= WINDOW_SIZE
+        const uint8_t* frame;
+        uint8_t frame_len;
+        driver.recv_view(&frame, &frame_len);
+
+        // the reply to FRAME_END (or UTD to FRAME_BEGIN) may have been
+        // lost, nothing else is taken anymore, in a fleet update only
+        // frames sent to this node count, broadcasts are for the rest
+        if (finished) {
+            bool addressed = !multicast || driver.headerTo() != DEFAULT_ADDRESS;
+            uint8_t frame_type = frame_len ? frame[0] : 0xFF;
+            driver.release();
+            if (!addressed) continue;
+            finished_time = millis();
+            // a programmer that saw FRAME_END held past a missing frame
+            // doesn't send it again, it only asks for an ACK
+            if (frame_type == FRAME_END || frame_type == FRAME_BEGIN ||
+                (!multicast && (flags & FLAG_ACK_REQUEST))) {
+                send_result(driver, finished);
+            } else if (frame_type == FRAME_POLL) {
+                uint8_t status = (has_manifest ? POLL_HAS_MANIFEST : 0) | (up_to_date ? POLL_UP_TO_DATE : 0);
+                send_missing_pages(driver, status, missing);
+            }
+            continue;
+        }
+
+        // queries don't touch flash, answer them right away
+        if (frame_len >= 3 && frame[0] == FRAME_QUERY) {
+            uint8_t first_page = frame[1];
+            uint8_t count = frame[2];
+            driver.release();
+            send_page_digests(driver, first_page, count);
+            continue;
+        }
+
+        if (frame_len >= 1 && frame[0] == FRAME_POLL) {
+            bool polled = driver.headerTo() != DEFAULT_ADDRESS;
+            driver.release();
+            if (polled) {
+                flash_wait();
+                mark_failed_page(failed, missing, &failed_seen);
+                uint8_t status = (has_manifest ? POLL_HAS_MANIFEST : 0) | (up_to_date ? POLL_UP_TO_DATE : 0);
+                send_missing_pages(driver, status, missing);
+            }
+            continue;
+        }
 
-        // format of buffer ihex
-        // <record_type><address high><address low><data_len><data><checksum>
+        // our RDY was lost and the programmer is still asking, it
+        // isn't a frame and doesn't take a place in the window
+        if (frame_len >= 4 && memcmp(frame, "BOOT", 4) == 0) {
+            driver.release();
+            send_ready(driver);
+            continue;
+        }
 
-        uint8_t data_len   = buffer[0];
-        uint16_t address   = (buffer[1] << 8) | buffer[2];
-        uint8_t record_type = buffer[3];
-        uint8_t* data       = &buffer[4];
-        uint8_t checksum   = buffer[4 + data_len];
+        if (ahead < WINDOW_SIZE) {
+            uint8_t slot = id % WINDOW_SIZE;
+            memcpy(window[slot], frame, frame_len);
+            window_len[slot] = frame_len;
+            window_mask |= (1 << ahead);
+        }
+        // otherwise it was already processed (our ACK was lost) or is too far ahead
+        driver.release();
+
+        // process everything that is now in order
+        while (window_mask & 1) {
+            uint8_t slot = next_id % WINDOW_SIZE;
+            uint8_t* buffer = window[slot];
+            uint8_t frame_len = window_len[slot];
+
+            // format of buffer
+            // <type><address high><address low><data...>
 
-        // checksum is the sum of all bytes
-        // then 
-        uint8_t calc = data_len + buffer[1] + buffer[2] + record_type;
-        for (int i = 0; i < data_len; i++) calc += data[i];
-        calc = (~calc + 1);
+            uint8_t frame_type = buffer[0];
+            uint16_t address   = (buffer[1] << 8) | buffer[2];
+            uint8_t* data       = &buffer[FRAME_DATA_HEADER_LEN];
+            uint8_t data_len   = frame_len - FRAME_DATA_HEADER_LEN;
 
-        if (calc == checksum) {
-            switch (record_type) {
+            switch (frame_type) {
                 // data
-                case 0x00: {
-                    // add recovery bytes on first write
+                case FRAME_DATA:
+                case FRAME_ZDATA: {
+                    // never write over the bootloader
+                    if (frame_len < FRAME_DATA_HEADER_LEN || address >= BOOT_START) {
+                        // drop it, the next ACK shows it missing
+                        window_mask &= ~1;
+                        break;
+                    }
+
+                    // nothing to write, or a repair for another node
+                    uint8_t page = address / SPM_PAGESIZE;
+                    if (multicast && (up_to_date || !(missing[page / 8] & (1 << (page % 8))))) break;
+
+                    // set the recovery marker on first write
                     if (!is_flash_modified) {
-                        set_recovery_state(true);
+                        mark_update_running(has_manifest);
                         is_flash_modified = true;
                     }
 
@@ -165,64 +358,239 @@ bool program_flash(Radio &driver) {
                     uint16_t page_addr = address & ~(SPM_PAGESIZE - 1);
 
                     // setup new page
-                    if (current_page_addr != page_addr) {
+                    // a fleet page that's sent again starts over, its
+                    // lz stream may refer to bytes that were missing
+                    if (current_page_addr != page_addr || (multicast && part == 0)) {
                         // if a previous page was dirty, write it to flash
-                        if (page_dirty && current_page_addr != 0xFFFF) {
-                            // atomic operation
-                            write_page(current_page_addr, page_buffer, SPM_PAGESIZE);
+                        // it's programmed in the background while the
+                        // next frames keep coming in
+                        // a fleet page still dirty here is incomplete
+                        if (page_dirty && current_page_addr != 0xFFFF && !multicast) {
+                            if (has_manifest && ++unsaved_pages >= RESUME_CHECKPOINT_PAGES) {
+                                flash_wait();
+                                mark_failed_page(failed, missing, &failed_seen);
+                                save_resume_page(written_page_addr, failed);
+                                unsaved_pages = 0;
+                            }
+                            flash_write_page(current_page_addr, page_buffer);
+                            mark_failed_page(failed, missing, &failed_seen);
+                            written_page_addr = current_page_addr;
                         }
 
                         current_page_addr = page_addr;
-                        page_dirty = false;
+                        // sent again, it's only failed if this write is too
+                        failed[page / 8] &= ~(1 << (page % 8));
+                        // a page is written even if no data follows,
+                        // trailing 0xFF is never sent
+                        page_dirty = true;
                         // cool trick to save clock cycles
                         // tldr; comparing against 0 is faster than some other value
                         for (int i = SPM_PAGESIZE; i != 0; --i) page_buffer[i - 1] = 0xFF;
+                        page_parts = 0;
+                        page_last = 0xFF;
                     }
 
                     uint16_t offset = address - current_page_addr;
-                    for (int i = 0; i < data_len && (offset + i) < SPM_PAGESIZE; i++) {
-                        page_buffer[offset + i] = data[i];
-                        page_dirty = true;
+                    if (frame_type == FRAME_ZDATA) {
+                        if (!lz_unpack(page_buffer, offset, data, data_len)) {
+                            // corrupt stream, drop it like any bad frame
+                            window_mask &= ~1;
+                            break;
+                        }
+                    } else {
+                        for (int i = 0; i < data_len && (offset + i) < SPM_PAGESIZE; i++) {
+                            page_buffer[offset + i] = data[i];
+                        }
                     }
 
-                    // ack
-                    driver.send((const uint8_t*)"PRG", 3);
+                    // a fleet page goes out as soon as every frame of it is in
+                    if (multicast && part < 8) {
+                        page_parts |= 1 << part;
+                        if (flags & FLAG_PAGE_END) page_last = part;
+                        if (page_last != 0xFF && page_parts == (uint8_t)((2 << page_last) - 1)) {
+                            flash_write_page(current_page_addr, page_buffer);
+                            mark_failed_page(failed, missing, &failed_seen);
+                            missing[page / 8] &= ~(1 << (page % 8));
+                            page_dirty = false;
+                            current_page_addr = 0xFFFF;
+                        }
+                    }
+                    break;
+                }
+
+                case FRAME_ERASE: {
+                    uint16_t page_addr = (uint16_t)buffer[1] * SPM_PAGESIZE;
+                    if (frame_len < 3 || page_addr >= BOOT_START) {
+                        window_mask &= ~1;
+                        break;
+                    }
+                    if (up_to_date) break;
+
+                    if (!is_flash_modified) {
+                        mark_update_running(has_manifest);
+                        is_flash_modified = true;
+                    }
+
+                    // the page being filled comes before the range
+                    if (page_dirty && current_page_addr != 0xFFFF && !multicast) {
+                        flash_write_page(current_page_addr, page_buffer);
+                        mark_failed_page(failed, missing, &failed_seen);
+                        written_page_addr = current_page_addr;
+                        unsaved_pages++;
+                    }
+                    page_dirty = false;
+                    current_page_addr = 0xFFFF;
+
+                    // each erase runs while the radio keeps receiving,
+                    // the programmer keeps ranges short
+                    for (uint8_t count = buffer[2]; count != 0 && page_addr < BOOT_START; --count) {
+                        if (!flash_page_blank(page_addr)) flash_erase_page(page_addr);
+                        mark_failed_page(failed, missing, &failed_seen);
+                        uint8_t page = page_addr / SPM_PAGESIZE;
+                        missing[page / 8] &= ~(1 << (page % 8));
+                        failed[page / 8] &= ~(1 << (page % 8));
+                        written_page_addr = page_addr;
+                        unsaved_pages++;
+                        page_addr += SPM_PAGESIZE;
+                    }
+
+                    if (has_manifest && !multicast && unsaved_pages >= RESUME_CHECKPOINT_PAGES) {
+                        save_resume_page(written_page_addr, failed);
+                        unsaved_pages = 0;
+                    }
+                    break;
+                }
+
+                case FRAME_BEGIN: {
+                    if (frame_len < 1 + MANIFEST_LEN) break;
+                    memcpy(manifest, &buffer[1], MANIFEST_LEN);
+                    // can't be checked, take the image without it
+                    if ((uint16_t)(manifest[0] | (manifest[1] << 8)) > BOOT_START) break;
+
+                    // already installed, nothing to write
+                    uint8_t installed[MANIFEST_LEN];
+                    flash_wait();
+                    eeprom_read_block(installed, INSTALLED_MANIFEST_ADDR, MANIFEST_LEN);
+                    if (eeprom_read_byte(UPDATE_STATE_ADDR) == UPDATE_VERIFIED &&
+                        memcmp(installed, manifest, MANIFEST_LEN) == 0) {
+                        // the rest of the fleet still needs the broadcast,
+                        // answered at FRAME_END
+                        if (multicast) {
+                            up_to_date = true;
+                            has_manifest = true;
+                            break;
+                        }
+                        send_result(driver, "UTD");
+                        finished = "UTD";
+                        finished_time = millis();
+                        break;
+                    }
+
+                    // a different image starts over
+                    uint16_t image_id = manifest[2] | (manifest[3] << 8);
+                    if (eeprom_read_word(RESUME_IMAGE_ADDR) != image_id) {
+                        eeprom_update_word(RESUME_IMAGE_ADDR, image_id);
+                        eeprom_update_byte(RESUME_PAGE_ADDR, 0);
+                    }
+                    has_manifest = true;
                     break;
                 }
 
                 // eof
-                case 0x01: {
-                    if (page_dirty && current_page_addr != 0xFFFF) {
-                        write_page(current_page_addr, page_buffer, SPM_PAGESIZE);
+                case FRAME_END: {
+                    const char* reply = "DNE";
+
+                    if (up_to_date) {
+                        reply = "UTD";
+                    } else {
+                        if (page_dirty && current_page_addr != 0xFFFF && !multicast) {
+                            flash_write_page(current_page_addr, page_buffer);
+                            page_dirty = false;
+                            current_page_addr = 0xFFFF;
+                        }
+
+                        // the last page is read back too, a failed page is
+                        // named in the ACK and FRAME_END held until the
+                        // programmer has sent it again
+                        flash_wait();
+                        mark_failed_page(failed, missing, &failed_seen);
+                        if (!multicast && bitmap_len(failed)) {
+                            window_mask &= ~1;
+                            break;
+                        }
+
+                        if (has_manifest) {
+                            // the whole image has to check out before the
+                            // marker goes, the radio CRC only covers frames
+                            uint32_t crc;
+                            memcpy(&crc, &manifest[2], sizeof(crc)); // both little-endian
+                            if (flash_crc32(manifest[0] | (manifest[1] << 8)) != crc) {
+                                // some page is bad, resuming would skip it
+                                eeprom_update_byte(RESUME_PAGE_ADDR, 0);
+                                reply = "BAD";
+                            } else {
+                                // still marked while the manifest is written
+                                set_update_state(UPDATE_RUNNING);
+                                eeprom_update_block(manifest, INSTALLED_MANIFEST_ADDR, MANIFEST_LEN);
+                                set_update_state(UPDATE_VERIFIED);
+                                up_to_date = true;
+                            }
+                        } else {
+                            // without a manifest the read back is all there is,
+                            // a page sent again after it failed counts once it
+                            // reads back right, a fleet node can't even tell
+                            // which pages it never got
+                            if (multicast || bitmap_len(failed)) {
+                                reply = "BAD";
+                            } else {
+                                // success write
+                                set_update_state(UPDATE_IDLE);
+                            }
+                        }
+                        flash_wait();
                     }
 
-                    // success write
-                    set_recovery_state(false);
+                    send_result(driver, reply);
 
-                    driver.send((const uint8_t*)"DNE", 3);
-                    driver.wait_packet_send();
-                    LED_ON;
-                    return true;
+                    // the programmer only hears from this node again
+                    // if the reply made it, stay for another FRAME_END
+                    finished = reply;
+                    finished_time = millis();
+                    break;
                 }
-                // there's more data types,
-                // but I'll implement them as I need them
-                // ignore for now
+
+                // unknown frames are rejected, a programmer that
+                // speaks another protocol doesn't get to move the window
                 default:
-                    driver.send((const uint8_t*)"PRG", 3);
+                    window_mask &= ~1;
                     break;
             }
-        } else {
-            driver.send((const uint8_t*)"CHK", 3);
+
+            // rejected, the next ACK shows it missing
+            if (!(window_mask & 1)) {
+                led_play(LED_ERROR);
+                break;
+            }
+
+            next_id++;
+            window_mask >>= 1;
         }
 
+        // the sender marks the last frame of a burst
+        // everything before it is acked at once
+        // the reply to FRAME_END (or FRAME_BEGIN) stands in for it
+        if (!(flags & FLAG_ACK_REQUEST) || finished) continue;
+
+        // with the pages that are failed, so the programmer can send
+        // them again, up to the last one, nothing at all usually
+        uint8_t ack[5 + POLL_BITMAP_LEN] = { 'A', 'C', 'K', next_id, window_mask };
+        uint8_t failed_len = bitmap_len(failed);
+        memcpy(&ack[5], failed, failed_len);
+        driver.send(ack, 5 + failed_len);
         driver.wait_packet_send();
 
-        // blink feedback
-        LED_ON;
-        delay(50);
-        LED_OFF;
-        delay(50);
-        LED_ON;
+        // blink feedback, played in the background
+        led_play(LED_ACK);
     }
     return false;
 }
\ No newline at end of file
@@ -1,7 +1,100 @@
 #pragma once
 #include "radio.h"
 
-#define BUFFER_SIZE 21
+#define BUFFER_SIZE RADIO_MAX_MESSAGE_LEN
+
+// frame types, first byte of every frame from the programmer
+// data frames never cross a page, the programmer splits pages
+// into as few frames as fit in a radio message
+#define FRAME_DATA 0x00 // <type><address high><address low><data...>
+#define FRAME_END 0x01 // <type>
+// answered right away, outside of the window
+// reply: <'C'><'R'><'C'><first page><crc16 low><crc16 high>...
+// one CRC-CCITT (init 0xFFFF) per page, as many as fit in a message
+#define FRAME_QUERY 0x02 // <type><first page><page count>
+// same as FRAME_DATA, but the data is an lz stream (see lz.h)
+// the address is where the unpacked bytes start
+#define FRAME_ZDATA 0x03 // <type><address high><address low><lz stream...>
+// manifest of the image, first frame of every update
+// the node answers it with <'U'><'T'><'D'> instead of an ACK and
+// leaves if it's the image it already has, after FRAME_END the
+// image is checked against it and <'B'><'A'><'D'> sent instead of
+// <'D'><'N'><'E'> if it doesn't match (a fleet node without a
+// manifest always gets BAD), a RADIO_PROFILE build adds
+// <isr ticks low><isr ticks high> to any of the three, see isrTicksMax()
+// the node stays until FINISHED_LINGER_MS (config.h) pass without
+// another FRAME_END or FRAME_BEGIN, answering them again, in case
+// its reply was lost
+#define FRAME_BEGIN 0x04 // <type><manifest>
+// erase page count pages starting at page index first page, pages
+// that already read as erased are skipped, so the programmer can clear
+// everything past an image that shrank without a write per page
+// pages must still come in ascending order, with the other frames
+#define FRAME_ERASE 0x05 // <type><first page><page count>
+// answered right away, by the node it's addressed to only, a broadcast
+// one just keeps the nodes of a fleet update from timing out
+// reply: <'N'><'A'><'K'><status><bitmap>, bit i of the bitmap is set
+// while page i of the application section is missing
+#define FRAME_POLL 0x06 // <type>
+#define FRAME_DATA_HEADER_LEN 3
+
+// <image length low><image length high><crc32, little endian><version low><version high>
+// the image is the application section from 0 up to length, what
+// the programmer didn't send counts as erased (0xFF)
+// crc32 is the IEEE CRC-32 (zlib.crc32), version is up to the user
+#define MANIFEST_LEN 8
+
+// resumable updates
+// the node keeps the low 16 bits of the manifest's CRC as the image
+// id in EEPROM, with the first page it hasn't committed yet (pages
+// are written in ascending order)
+// the resume page is 0 unless an update of that image was cut short,
+// the programmer can then skip every page below it
+// progress is saved when the programmer goes quiet, and every
+// RESUME_CHECKPOINT_PAGES pages in case power is lost instead
+#define RESUME_CHECKPOINT_PAGES 16
+
+// RDY: <'R'><'D'><'Y'><max message len><update state>
+// <image id low><image id high><resume page><version low><version high>
+// the version is the one of the verified image in flash, 0xFFFF
+// if there isn't one
+// a BOOT that comes in during the update is answered with RDY again
+#define UPDATE_STATE_LEN 5
+
+// sliding window
+// frames are numbered with the radio header id, the node buffers
+// frames that arrive ahead of a missing one and reports what it
+// holds in every ACK: <'A'><'C'><'K'><next expected id><bitmap><failed pages>
+// bit i of the bitmap is frame (next expected id + i)
+// failed pages has a bit per page like FRAME_POLL's, set while the
+// page didn't read back as written, cut after the last byte with a
+// bit set (empty while there are none). FRAME_END isn't taken until
+// the programmer has sent those pages again, a page may come again
+// after the ones past it
+#define WINDOW_SIZE 8 // max 8, the bitmap is one byte
+#define FLAG_ACK_REQUEST 0x01 // header flag, sender is waiting for an ACK
+
+// fleet updates
+// the programmer broadcasts the image once to every node, with
+// FLAG_MULTICAST set, those frames skip the window and are taken as
+// they come: the header id is the frame's place in its page, the last
+// one has FLAG_PAGE_END, and a page is only written once all of its
+// frames are in. Each node is then polled on its own address (see
+// FRAME_POLL) and the pages any of them is missing are broadcast
+// again, from their first frame, a page that didn't read back as
+// written counts as missing again. FRAME_END goes to each node on its
+// own and is answered like in a normal update, a node that already
+// had the image answers it with UTD, one that never got FRAME_BEGIN
+// with BAD. The node then stays until FINISHED_LINGER_MS (config.h)
+// pass without a FRAME_END or FRAME_POLL sent to it, answering them
+// again, in case its reply was lost
+#define FLAG_MULTICAST 0x02
+#define FLAG_PAGE_END 0x04
+#define POLL_HAS_MANIFEST 0x01 // status, FRAME_BEGIN came through
+#define POLL_UP_TO_DATE 0x02 // status, it's the installed image
+#define POLL_BITMAP_LEN (BOOT_START / SPM_PAGESIZE / 8)
 
 bool program_flash(Radio &driver);
-bool check_recovery_bytes(void);
\ No newline at end of file
+bool check_recovery_bytes(void);
+void read_update_state(uint8_t* state);
+void send_ready(Radio &driver);
\ No newline at end of file
@@ -14,6 +14,26 @@ static const uint8_t PROGMEM symbols[16] = {
 };
 #define SYMBOL(i) (pgm_read_byte(&symbols[(i)]))
 
+// reverse of symbols, indexed by the received 6-bit symbol
+static const uint8_t PROGMEM symbol_values[64] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x01, 0xff,
+    0xff, 0xff, 0xff, 0x02, 0xff, 0x03, 0x04, 0xff,
+    0xff, 0x05, 0x06, 0xff, 0x07, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0x08, 0xff, 0x09, 0x0a, 0xff,
+    0xff, 0x0b, 0x0c, 0xff, 0x0d, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0x0e, 0xff, 0x0f, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+#if RADIO_CRC_TABLE
+// CRC-CCITT (0x8408) of each nibble
+static const uint16_t PROGMEM crc_nibbles[16] = {
+    0x0000, 0x1081, 0x2102, 0x3183, 0x4204, 0x5285, 0x6306, 0x7387,
+    0x8408, 0x9489, 0xa50a, 0xb58b, 0xc60c, 0xd68d, 0xe70e, 0xf78f
+};
+#endif
+
 #define NUM_PRESCALERS 7
 static const uint16_t PROGMEM prescalers[NUM_PRESCALERS] = {
     0, 1, 8, 64, 256, 1024, 3333
@@ -23,13 +43,29 @@ static const uint16_t PROGMEM prescalers[NUM_PRESCALERS] = {
 // looking for a better way to do this
 static Radio* radioRef;
 
+#if RADIO_PROFILE
+static volatile uint16_t isr_ticks_max;
+#define PROFILE_ISR(start) do { \
+        uint16_t ticks = TCNT1 - (start); \
+        if (ticks > isr_ticks_max) isr_ticks_max = ticks; \
+    } while (0)
+#else
+#define PROFILE_ISR(start) ((void)(start))
+#endif
+
 Radio::Radio():
     mode(RadioMode::Idle),
     address(DEFAULT_ADDRESS),
     tx_header_to(DEFAULT_ADDRESS),
     tx_header_from(DEFAULT_ADDRESS),
     tx_header_id(0),
-    tx_header_flags(0)
+    tx_header_flags(0),
+    rx_sense_count(0),
+    rx_carrier(false),
+    rx_buffer_valid(false),
+    rx_head(0),
+    rx_tail(0),
+    rx_ready(0)
 {
     // attach preamble to tx buffer
     for (int i = PREAMBLE_LEN; i != 0; --i) {
@@ -44,23 +80,37 @@ bool Radio::init() {
     // set tx as output
     RADIO_DDR |= (1 << RADIO_TX_PIN);
     // set rx as input
+#if RADIO_RX_CAPTURE
+    RADIO_CAPTURE_DDR &= ~(1 << RADIO_CAPTURE_BIT);
+#else
     RADIO_DDR &= ~(1 << RADIO_RX_PIN);
+#endif
 
     // set mode to idle
     this->set_mode_idle();
 
+#if RADIO_RX_CAPTURE
+    // timer1 runs free so capture timestamps can be subtracted,
+    // compare A is scheduled by hand while transmitting
+    // noise canceler on, prescaler 8
+    TCCR1A = 0;
+    TCCR1B = (1 << ICNC1) | (1 << CS11);
+#else
     // setup clock (timer1)
     uint16_t ticks;
     uint8_t prescalar;
 
-    prescalar = this->timerCalc(RADIO_SPEED, (uint16_t) -1, &ticks);
+    // leave room for the bit period used while transmitting
+    prescalar = this->timerCalc(RADIO_SPEED, (uint16_t) -1 / RADIO_RX_SAMPLES_PER_BIT, &ticks);
     if (!prescalar) return false;
 
+    this->sample_ticks = ticks;
     TCCR1A = 0;
     TCCR1B = (1 << WGM12); // CTC
     TCCR1B |= prescalar;
     OCR1A = ticks;
     TIMSK1 |= (1 << OCIE1A);
+#endif
 
     return true;
 }
@@ -68,74 +118,101 @@ bool Radio::init() {
 bool Radio::available() {
     if (this->mode == RadioMode::Tx) return false;
     this->set_mode_rx();
-    if (this->rx_buffer_full) {
+    // drop complete frames that don't validate
+    while (!this->rx_buffer_valid && this->rx_ready) {
         this->validate_rx_buffer();
-        this->rx_buffer_full = false;
+        if (!this->rx_buffer_valid) this->release();
     }
     return this->rx_buffer_valid;
 }
 
 bool Radio::recv(uint8_t* buffer, uint8_t* len) {
-    if (!this->available()) return false;
+    const uint8_t* message;
+    uint8_t message_len;
+    if (!this->recv_view(&message, &message_len)) return false;
 
     if (buffer && len) {
-        uint8_t message_len = this->rx_buffer_len - RADIO_HEADER_LEN - 3;
         if (*len > message_len) *len = message_len;
 
         for (int i = *len; i != 0; --i) {
-            buffer[i - 1] = this->rx_buffer[RADIO_HEADER_LEN + 1 + (i - 1)];
+            buffer[i - 1] = message[i - 1];
         }
     }
 
-    this->rx_buffer_valid = false;
+    this->release();
     return true;
 }
 
+// points into the oldest slot instead of copying it out
+bool Radio::recv_view(const uint8_t** buffer, uint8_t* len) {
+    if (!this->available()) return false;
+
+    RadioSlot* slot = &this->rx_slots[this->rx_tail];
+    *buffer = slot->buffer + RADIO_HEADER_LEN + 1;
+    *len = slot->len - RADIO_HEADER_LEN - 3 - RADIO_FEC_LEN;
+    return true;
+}
+
+// hand the oldest slot back to the receiver
+void Radio::release() {
+    if (!this->rx_ready) return;
+    this->rx_buffer_valid = false;
+    if (++this->rx_tail == RADIO_RX_SLOTS) this->rx_tail = 0;
+    // the ISR counts up, so decrement atomically
+    cli();
+    this->rx_ready--;
+    sei();
+}
+
 bool Radio::send(const uint8_t* data, uint8_t len) {
     if (len > RADIO_MAX_MESSAGE_LEN) return false;
     // wait for tx to be ready
     this->wait_packet_send();
     
     uint8_t i;
-    uint16_t index = 0;
+    uint8_t index = 0;
     uint16_t crc = 0xFFFF;
-    uint8_t* message = this->tx_buffer + PREAMBLE_LEN;
-    uint8_t count = len + 3 + RADIO_HEADER_LEN; // data + fcs + headers
+    uint8_t count = len + 3 + RADIO_HEADER_LEN + RADIO_FEC_LEN; // data + fcs + headers + parity
+
+#if RADIO_FEC_LEN
+    for (i = 0; i < RADIO_FEC_LEN; i++) this->tx_parity[i] = 0;
+#endif
 
     // encode message length
     crc = this->updateCRC(crc, count);
-    message[index++] = SYMBOL(count >> 4);
-    message[index++] = SYMBOL(count & 0x0F);
+    index = this->encode(index, count);
     
     // encode headers
     crc = this->updateCRC(crc, this->tx_header_to);
-    message[index++] = SYMBOL(this->tx_header_to >> 4);
-    message[index++] = SYMBOL(this->tx_header_to & 0x0F);
+    index = this->encode(index, this->tx_header_to);
     
     crc = this->updateCRC(crc, this->tx_header_from);
-    message[index++] = SYMBOL(this->tx_header_from >> 4);
-    message[index++] = SYMBOL(this->tx_header_from & 0x0F);
+    index = this->encode(index, this->tx_header_from);
     
     crc = this->updateCRC(crc, this->tx_header_id);
-    message[index++] = SYMBOL(this->tx_header_id >> 4);
-    message[index++] = SYMBOL(this->tx_header_id & 0x0F);
+    index = this->encode(index, this->tx_header_id);
     
     crc = this->updateCRC(crc, this->tx_header_flags);
-    message[index++] = SYMBOL(this->tx_header_flags >> 4);
-    message[index++] = SYMBOL(this->tx_header_flags & 0x0F);
+    index = this->encode(index, this->tx_header_flags);
 
     // encode the message into 6 bit symbols
     for (i = 0; i < len; i++) {
         crc = this->updateCRC(crc, data[i]);
-        message[index++] = SYMBOL(data[i] >> 4);
-        message[index++] = SYMBOL(data[i] & 0x0F);
+        index = this->encode(index, data[i]);
     }
     
     crc = ~crc;
-    message[index++] = SYMBOL((crc >> 4)  & 0x0F);
-    message[index++] = SYMBOL(crc & 0x0F);
-    message[index++] = SYMBOL((crc >> 12) & 0x0F);
-    message[index++] = SYMBOL((crc >> 8)  & 0x0F);
+    index = this->encode(index, crc & 0xFF);
+    index = this->encode(index, crc >> 8);
+
+#if RADIO_FEC_LEN
+    // parity goes last, each byte lands in the group it closes
+    // so every group XORs to 0 at the receiver
+    for (i = 0; i < RADIO_FEC_LEN; i++) {
+        index = this->encode(index, this->tx_parity[(index / 2) % RADIO_FEC_LEN]);
+    }
+#endif
+
     // Total number of 6-bit symbols to send
     this->tx_buffer_len = index + PREAMBLE_LEN;
 
@@ -144,15 +221,48 @@ bool Radio::send(const uint8_t* data, uint8_t len) {
     return true;
 }
 
+// each byte is sent as two 6-bit symbols, high nibble first
+// returns the index of the next symbol
+uint8_t Radio::encode(uint8_t index, uint8_t data) {
+    uint8_t* message = this->tx_buffer + PREAMBLE_LEN;
+
+#if RADIO_FEC_LEN
+    this->tx_parity[(index / 2) % RADIO_FEC_LEN] ^= data;
+#endif
+
+    message[index++] = SYMBOL(data >> 4);
+    message[index++] = SYMBOL(data & 0x0F);
+    return index;
+}
+
 bool Radio::wait_packet_send() {
     while (this->mode == RadioMode::Tx);
     return true;
 }
 
+// non-blocking alternative to wait_packet_send()
+bool Radio::sending() {
+    return this->mode == RadioMode::Tx;
+}
+
+// read and clear, the ISR may set it again in between
+bool Radio::carrier() {
+    cli();
+    bool heard = this->rx_carrier;
+    this->rx_carrier = false;
+    sei();
+    return heard;
+}
+
 void Radio::set_mode_idle() {
     if (this->mode == RadioMode::Idle) return;
     // disable tx hardware
     RADIO_PORT &= ~(1 << RADIO_TX_PIN);
+#if RADIO_RX_CAPTURE
+    TIMSK1 &= ~((1 << OCIE1A) | (1 << OCIE1B) | (1 << ICIE1));
+#else
+    if (this->mode == RadioMode::Tx) this->set_timer_ticks(this->sample_ticks);
+#endif
     this->mode = RadioMode::Idle;
 }
 
@@ -160,6 +270,20 @@ void Radio::set_mode_rx() {
     if (this->mode == RadioMode::Rx) return;
     // disable rx hardware
     RADIO_PORT &= ~(1 << RADIO_TX_PIN);
+#if RADIO_RX_CAPTURE
+    // wait for the edge that leaves the current level
+    TIMSK1 &= ~((1 << OCIE1A) | (1 << OCIE1B));
+    if (RADIO_CAPTURE_PIN & (1 << RADIO_CAPTURE_BIT)) {
+        TCCR1B &= ~(1 << ICES1);
+    } else {
+        TCCR1B |= (1 << ICES1);
+    }
+    this->rx_last_edge = TCNT1;
+    TIFR1 = (1 << ICF1);
+    TIMSK1 |= (1 << ICIE1);
+#else
+    if (this->mode == RadioMode::Tx) this->set_timer_ticks(this->sample_ticks);
+#endif
     this->mode = RadioMode::Rx;
 }
 
@@ -167,31 +291,61 @@ void Radio::set_mode_tx() {
     if (this->mode == RadioMode::Tx) return;
     this->tx_index = 0;
     this->tx_bit = 0;
-    this->tx_sample = 0;
+    // one interrupt per bit, nothing to oversample on the way out
+#if RADIO_RX_CAPTURE
+    TIMSK1 &= ~((1 << OCIE1B) | (1 << ICIE1));
+    OCR1A = TCNT1 + RADIO_CAPTURE_TICKS_PER_BIT;
+    TIFR1 = (1 << OCF1A);
+    TIMSK1 |= (1 << OCIE1A);
+#else
+    this->set_timer_ticks((this->sample_ticks + 1) * RADIO_RX_SAMPLES_PER_BIT - 1);
+#endif
     this->mode = RadioMode::Tx;
 }
 
+#if !RADIO_RX_CAPTURE
+// restart the CTC period so a shorter top isn't already behind the counter
+void Radio::set_timer_ticks(uint16_t ticks) {
+    OCR1A = ticks;
+    TCNT1 = 0;
+}
+#endif
+
 // ensure message is complete and uncorrupted
+// the CRC and destination were already checked as the bytes came in,
+// what's left is rebuilding erased nibbles (FEC) and the headers
 void Radio::validate_rx_buffer()
 {
-    uint16_t crc = 0xFFFF;
-    // The CRC covers the byte count, headers and user data
-    for (uint8_t i = 0; i < this->rx_buffer_len; i++) {
-        crc = this->updateCRC(crc, this->rx_buffer[i]);
+    RadioSlot* slot = &this->rx_slots[this->rx_tail];
+
+#if RADIO_FEC_LEN
+    if (!this->correct_rx_buffer(slot)) {
+        this->rx_buffer_valid = false;
+        return;
+    }
+
+    if (slot->erased) {
+        // the running CRC saw 0 for every nibble that was rebuilt
+        uint16_t crc = 0xFFFF;
+        for (uint8_t i = 0; i < slot->len - RADIO_FEC_LEN; i++) {
+            crc = this->updateCRC(crc, slot->buffer[i]);
+        }
+        slot->crc = crc;
     }
 
     // CRC when buffer and expected CRC are CRC'd 
-    if (crc != 0xF0B8) {
+    if (slot->crc != 0xF0B8) {
         // Reject and drop the message
         this->rx_buffer_valid = false;
         return;
     }
+#endif
 
     // Extract the 4 headers that follow the message length
-    this->rx_header_to = this->rx_buffer[1];
-    this->rx_header_from = this->rx_buffer[2];
-    this->rx_header_id = this->rx_buffer[3];
-    this->rx_header_flags = this->rx_buffer[4];
+    this->rx_header_to = slot->buffer[1];
+    this->rx_header_from = slot->buffer[2];
+    this->rx_header_id = slot->buffer[3];
+    this->rx_header_flags = slot->buffer[4];
     
     if (
         this->rx_header_to == this->address ||
@@ -201,6 +355,41 @@ void Radio::validate_rx_buffer()
     }
 }
 
+#if RADIO_FEC_LEN
+// every symbol that did not decode was stored as 0 and its position
+// kept, one per group (byte position % RADIO_FEC_LEN, nibble)
+// the XOR of a group including its parity is 0, so the XOR of
+// what was received is the missing nibble
+bool Radio::correct_rx_buffer(RadioSlot* slot) {
+    if (slot->erasure_lost) return false;
+
+    for (uint8_t group = 0; group < RADIO_FEC_LEN * 2; group++) {
+        uint8_t erased = slot->erasures[group];
+        if (erased == RADIO_NO_ERASURE) continue;
+
+        uint8_t value = 0;
+        for (uint8_t i = erased % RADIO_FEC_LEN; i < slot->len; i += RADIO_FEC_LEN) {
+            value ^= slot->buffer[i];
+        }
+
+        // odd groups are the low nibble
+        slot->buffer[erased] |= (group & 1) ? (value & 0x0F) : (value & 0xF0);
+    }
+
+    return true;
+}
+
+// remember where a symbol failed to decode
+// a second one in the same group can't be recovered
+void Radio::mark_erasure(uint8_t byte, uint8_t low_nibble) {
+    uint8_t group = (byte % RADIO_FEC_LEN) * 2 + low_nibble;
+    if (this->rx_slot->erasures[group] != RADIO_NO_ERASURE) this->rx_slot->erasure_lost = true;
+    this->rx_slot->erasures[group] = byte;
+}
+#endif
+
+#if !RADIO_RX_CAPTURE
+// software PLL, samples the line RADIO_RX_SAMPLES_PER_BIT times per bit
 void Radio::receive_timer() {
     bool rx_sample = (RADIO_PIN & (1 << RADIO_RX_PIN)) != 0;
     if (rx_sample) this->rx_integrator++;
@@ -217,66 +406,189 @@ void Radio::receive_timer() {
 
     if (this->rx_pll_ramp < RADIO_RX_RAMP_LEN) return;
 
-    this->rx_bits >>= 1;
-    if (this->rx_integrator >= 5) this->rx_bits |= 0x800;
     this->rx_pll_ramp -= RADIO_RX_RAMP_LEN;
+    uint8_t integrator = this->rx_integrator;
+    this->receive_bit(integrator >= 5);
     this->rx_integrator = 0;
 
+    // clean when (nearly) every sample agreed, a line stuck at one
+    // level for 8 bits isn't a transmitter either
+    uint8_t recent = this->rx_bits >> 4;
+    this->sense(
+        (integrator <= 1 || integrator >= RADIO_RX_SAMPLES_PER_BIT - 1) &&
+        recent != 0x00 && recent != 0xFF
+    );
+}
+#else
+// edge timestamps from the input capture unit (ICP1)
+// the run that just ended is as many bits as fit in its width
+void Radio::receive_edge() {
+    uint16_t edge = ICR1;
+    // line level during the run, we were waiting for it to fall if high
+    bool level = !(TCCR1B & (1 << ICES1));
+    TCCR1B ^= (1 << ICES1);
+
+    this->receive_run(level, edge - this->rx_last_edge);
+    this->rx_last_edge = edge;
+
+    // if the line stays put, flush the run from the compare B interrupt
+    // otherwise the last bits of a frame would wait for the next edge
+    OCR1B = edge + RADIO_CAPTURE_FLUSH_BITS * RADIO_CAPTURE_TICKS_PER_BIT;
+    TIFR1 = (1 << OCF1B);
+    TIMSK1 |= (1 << OCIE1B);
+}
+
+void Radio::receive_flush() {
+    // one shot, the next edge arms it again
+    TIMSK1 &= ~(1 << OCIE1B);
+    bool level = !(TCCR1B & (1 << ICES1));
+    this->receive_run(level, RADIO_CAPTURE_FLUSH_BITS * RADIO_CAPTURE_TICKS_PER_BIT);
+    this->rx_last_edge = OCR1B;
+}
+
+void Radio::receive_run(bool level, uint16_t width) {
+    // round to the nearest bit, a glitch under half a bit adds nothing
+    // runs longer than a symbol are idle line, no need to count them all
+    width += RADIO_CAPTURE_TICKS_PER_BIT / 2;
+    uint8_t bits = 0;
+    for (; bits < 12 && width >= RADIO_CAPTURE_TICKS_PER_BIT; ++bits) {
+        width -= RADIO_CAPTURE_TICKS_PER_BIT;
+        this->receive_bit(level);
+    }
+
+    // clean when the run is a whole number of bits give or take a
+    // quarter, and no longer than the symbols allow
+    this->sense(
+        bits != 0 && bits <= 6 &&
+        width >= RADIO_CAPTURE_TICKS_PER_BIT / 4 &&
+        width < RADIO_CAPTURE_TICKS_PER_BIT * 3 / 4
+    );
+}
+#endif
+
+// shift in one bit, decode a byte every 12 bits (two symbols)
+void Radio::receive_bit(bool bit) {
+    this->rx_bits >>= 1;
+    if (bit) this->rx_bits |= 0x800;
+
     if (this->rx_active) {
         if (++this->rx_bit_count >= 12) {
-            uint8_t current_byte = (this->convert_to_4bit_symbols(this->rx_bits & 0x3F)) << 4 |
-                this->convert_to_4bit_symbols(this->rx_bits >> 6);
+            RadioSlot* slot = this->rx_slot;
+            uint8_t high = this->convert_to_4bit_symbols(this->rx_bits & 0x3F);
+            uint8_t low = this->convert_to_4bit_symbols(this->rx_bits >> 6);
+            bool erased = false;
+
+#if RADIO_FEC_LEN
+            // a flipped bit never turns one symbol into another
+            // (they all have three 1s), so bad symbols are erasures
+            if (high == RADIO_INVALID_SYMBOL || low == RADIO_INVALID_SYMBOL) {
+                // nothing to go on without the length
+                if (slot->len == 0) {
+                    this->rx_active = false;
+                    return;
+                }
+                if (high == RADIO_INVALID_SYMBOL) {
+                    this->mark_erasure(slot->len, 0);
+                    high = 0;
+                }
+                if (low == RADIO_INVALID_SYMBOL) {
+                    this->mark_erasure(slot->len, 1);
+                    low = 0;
+                }
+                erased = true;
+                slot->erased = true;
+            }
+#endif
+
+            uint8_t current_byte = (high << 4) | (low & 0x0F);
 
-            if (this->rx_buffer_len == 0) {
+            if (slot->len == 0) {
                 this->rx_count = current_byte;
-                if (this->rx_count < 7 || this->rx_count > RADIO_MAX_PAYLOAD_LEN) {
+                if (this->rx_count < 7 + RADIO_FEC_LEN || this->rx_count > RADIO_MAX_PAYLOAD_LEN) {
+                    this->rx_active = false;
+                    return;
+                }
+            } else if (slot->len == 1 && !erased) {
+                // addressed to someone else, go back to hunting for
+                // a start symbol instead of buffering the rest
+                if (current_byte != this->address && current_byte != DEFAULT_ADDRESS) {
                     this->rx_active = false;
                     return;
                 }
             }
-            this->rx_buffer[this->rx_buffer_len++] = current_byte;
 
-            if (this->rx_buffer_len >= this->rx_count) {
+            // parity isn't covered by the CRC
+            if (slot->len < this->rx_count - RADIO_FEC_LEN) {
+                slot->crc = this->updateCRC(slot->crc, current_byte);
+            }
+            slot->buffer[slot->len++] = current_byte;
+
+            if (slot->len >= this->rx_count) {
                 this->rx_active = false;
-                this->rx_buffer_full = true;
-                this->set_mode_idle();
+#if !RADIO_FEC_LEN
+                // corrupted, reuse the slot
+                if (slot->crc != 0xF0B8) return;
+#endif
+                // keep listening into the next slot
+                if (++this->rx_head == RADIO_RX_SLOTS) this->rx_head = 0;
+                this->rx_ready++;
             }
             this->rx_bit_count = 0;
         }
     } else if (this->rx_bits == RADIO_START_SYMBOL) {
+        this->rx_carrier = true;
+
+        // every slot is waiting for the application
+        if (this->rx_ready == RADIO_RX_SLOTS) return;
+
+        RadioSlot* slot = &this->rx_slots[this->rx_head];
+        this->rx_slot = slot;
         this->rx_active = true;
         this->rx_bit_count = 0;
-        this->rx_buffer_len = 0;
+        slot->len = 0;
+        slot->crc = 0xFFFF;
+#if RADIO_FEC_LEN
+        for (uint8_t i = 0; i < RADIO_FEC_LEN * 2; i++) slot->erasures[i] = RADIO_NO_ERASURE;
+        slot->erasure_lost = false;
+        slot->erased = false;
+#endif
     }
 }
 
+void Radio::sense(bool clean) {
+    if (!clean) {
+        this->rx_sense_count = 0;
+    } else if (++this->rx_sense_count >= RADIO_SENSE_LEN) {
+        this->rx_sense_count = 0;
+        this->rx_carrier = true;
+    }
+}
+
+// called once per bit while in Tx
 void Radio::transmit_timer() {
-    if (this->tx_sample++ == 0) {
-        if (this->tx_index >= this->tx_buffer_len) {
-            this->set_mode_idle();
-        } else {
-            if (this->tx_buffer[this->tx_index] & (1 << this->tx_bit++)) {
-                RADIO_PORT |= (1 << RADIO_TX_PIN);
-            } else {
-                RADIO_PORT &= ~(1 << RADIO_TX_PIN);
-            }
+    if (this->tx_index >= this->tx_buffer_len) {
+        this->set_mode_idle();
+        return;
+    }
 
-            if (this->tx_bit >= 6) {
-                this->tx_bit = 0;
-                this->tx_index++;
-            }
-        }
+    if (this->tx_buffer[this->tx_index] & (1 << this->tx_bit++)) {
+        RADIO_PORT |= (1 << RADIO_TX_PIN);
+    } else {
+        RADIO_PORT &= ~(1 << RADIO_TX_PIN);
     }
 
-    if (this->tx_sample > 7) {
-        this->tx_sample = 0;
+    if (this->tx_bit >= 6) {
+        this->tx_bit = 0;
+        this->tx_index++;
     }
 }
 
 void Radio::handle_timer_interrupt() {
     switch (this->mode) {
         case RadioMode::Rx:
+#if !RADIO_RX_CAPTURE
             this->receive_timer();
+#endif
             break;
         case RadioMode::Tx:
             this->transmit_timer();
@@ -287,11 +599,75 @@ void Radio::handle_timer_interrupt() {
 }
 
 ISR(TIMER1_COMPA_vect) {
+#if RADIO_RX_CAPTURE
+    uint16_t start = OCR1A;
+    // timer1 runs free, schedule the next bit
+    OCR1A += RADIO_CAPTURE_TICKS_PER_BIT;
+#else
+    uint16_t start = 0; // CTC cleared the count on the match
+#endif
     radioRef->handle_timer_interrupt();
+    PROFILE_ISR(start);
+}
+
+#if RADIO_RX_CAPTURE
+ISR(TIMER1_CAPT_vect) {
+    uint16_t start = ICR1;
+    radioRef->receive_edge();
+    PROFILE_ISR(start);
+}
+
+ISR(TIMER1_COMPB_vect) {
+    uint16_t start = OCR1B;
+    radioRef->receive_flush();
+    PROFILE_ISR(start);
+}
+#endif
+
+#if RADIO_PROFILE
+uint16_t Radio::isrTicksMax() {
+    uint16_t ticks;
+    // atomically read, the ISR may update it mid-read
+    cli();
+    ticks = isr_ticks_max;
+    sei();
+    return ticks;
 }
+#endif
 
 void Radio::setAddress(uint8_t address) {
     this->address = address;
+    this->tx_header_from = address;
+}
+
+void Radio::setHeaderTo(uint8_t to) {
+    this->tx_header_to = to;
+}
+
+void Radio::setHeaderId(uint8_t id) {
+    this->tx_header_id = id;
+}
+
+void Radio::setHeaderFlags(uint8_t flags) {
+    this->tx_header_flags = flags;
+}
+
+// headers of the last received message
+// only meaningful after available() returned true
+uint8_t Radio::headerTo() {
+    return this->rx_header_to;
+}
+
+uint8_t Radio::headerFrom() {
+    return this->rx_header_from;
+}
+
+uint8_t Radio::headerId() {
+    return this->rx_header_id;
+}
+
+uint8_t Radio::headerFlags() {
+    return this->rx_header_flags;
 }
 
 // TODO: precompute these values
@@ -338,6 +714,11 @@ uint8_t Radio::timerCalc(uint16_t speed, uint16_t max_ticks, uint16_t *nticks) {
 }
 
 uint16_t Radio::updateCRC(uint16_t crc, uint8_t data) {
+#if RADIO_CRC_TABLE
+    crc = (crc >> 4) ^ pgm_read_word(&crc_nibbles[(crc ^ data) & 0x0F]);
+    crc = (crc >> 4) ^ pgm_read_word(&crc_nibbles[(crc ^ (data >> 4)) & 0x0F]);
+    return crc;
+#else
     data ^= ((crc) & 0xFF); 
     data ^= data << 4;
 
@@ -346,15 +727,10 @@ uint16_t Radio::updateCRC(uint16_t crc, uint8_t data) {
         (uint8_t)(data >> 4) ^
         ((uint16_t)data << 3)
     );
+#endif
 }
 
+// 0xFF (RADIO_INVALID_SYMBOL) if it isn't one of the 16 symbols
 uint8_t Radio::convert_to_4bit_symbols(uint8_t symbol) {
-    uint8_t i;
-    uint8_t count;
-
-    for (i = (symbol >> 2) & 8, count = 8; count--; i++) {
-        if (symbol == SYMBOL(i)) return i;
-    }
-
-    return 0;
-}
\ No newline at end of file
+    return pgm_read_byte(&symbol_values[symbol & 0x3F]);
+}
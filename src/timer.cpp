@@ -1,4 +1,5 @@
 #include "timer.h"
+#include "led.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
@@ -6,6 +7,7 @@ static volatile uint32_t _millis = 0;
 
 ISR(TIMER0_COMPA_vect) {
     ++_millis;
+    led_tick();
 }
 
 void timer_init(void) {
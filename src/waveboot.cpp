@@ -9,11 +9,14 @@
 #include <avr/interrupt.h>
 #include <avr/sfr_defs.h>
 #include <avr/io.h>
+#include <avr/eeprom.h>
 
 #include "config.h"
 #include "timer.h"
 #include "radio.h"
 #include "program.h"
+#include "flash.h"
+#include "led.h"
 
 typedef void (*app_entry_t)(void) __attribute__((noreturn));
 
@@ -30,6 +33,9 @@ static inline void map_vectors_to_application(void) {
 }
 
 static void jump_to_application(void) {
+    // a page may still be programming in the background
+    flash_wait();
+
     // disable all interrupts
     cli();
 
@@ -69,10 +75,42 @@ static void jump_to_application(void) {
     while(1);
 }
 
-static bool listen_for_boot_signal(Radio &driver, uint32_t timeout) {
+// the application asks for an update by leaving BOOT_REQUEST_MAGIC
+// at BOOT_REQUEST_ADDR and resetting with the watchdog
+// RAM is garbage after power-up, so the word only counts after a
+// watchdog reset, and it's cleared so it's only honoured once
+static bool boot_requested(uint8_t reset_flags) {
+    volatile uint16_t* request = (volatile uint16_t*)BOOT_REQUEST_ADDR;
+    bool requested = (reset_flags & (1 << WDRF)) && *request == BOOT_REQUEST_MAGIC;
+    *request = 0;
+    return requested;
+}
+
+// quiet is how long the channel may go without a transmitter before
+// giving up early (carrier sense), 0 always waits out the timeout
+// while something is on the air the window is held open, so a BOOT
+// that is in flight when it would close still makes it, at most
+// BOOT_HOLD_MS past the timeout
+static bool listen_for_boot_signal(Radio &driver, uint32_t timeout, uint32_t quiet) {
     uint32_t start_listen_time = millis();
+    uint32_t last_heard = start_listen_time;
+    uint32_t window = timeout;
+
+    // anything heard before we started listening doesn't count
+    driver.carrier();
+
+    while (millis() - start_listen_time < window) {
+        if (driver.carrier()) {
+            last_heard = millis();
+            if (quiet) {
+                uint32_t held = last_heard - start_listen_time + quiet;
+                if (held > timeout + BOOT_HOLD_MS) held = timeout + BOOT_HOLD_MS;
+                if (held > window) window = held;
+            }
+        } else if (quiet && millis() - last_heard >= quiet) {
+            return false;
+        }
 
-    while ((millis()) < start_listen_time + timeout) {
         uint8_t buf[4];
         uint8_t buf_len = sizeof(buf);
 
@@ -97,6 +135,7 @@ void bootloader_main(void) {
     // disable watchdog sequence
     cli();
     wdt_reset();
+    uint8_t reset_flags = MCUSR;
     MCUSR &= ~(1 << WDRF);
     WDTCSR |= (1 << WDCE) | (1 << WDE);
     WDTCSR = 0x00;
@@ -119,25 +158,29 @@ void bootloader_main(void) {
         } else {
             // recovery bytes exist - cooked
             // wait for user intervention
-            while (true) {
-                // LED_ON;
-                // delay(100);
-                // LED_OFF;
-                // delay(100);
-            }
+            led_play(LED_RECOVERY);
+            while (true);
         }
         return;
     }
 
+    // fleet updates poll each node on its own address, broadcasts
+    // (DEFAULT_ADDRESS) still reach it
+    driver.setAddress(eeprom_read_byte(NODE_ADDRESS_ADDR));
+
+    // only listen for long when there's an update waiting
+    bool requested = boot_requested(reset_flags);
+
     while (true) {
         bool is_corrupted = check_recovery_bytes();
         bool magic_recieved = false;
 
         if (is_corrupted) {
             // flash is corrupted - infinite wait for BOOT signal
+            led_play(LED_RECOVERY);
             while (true) {
                 // check forever for 10s every 1s
-                if (listen_for_boot_signal(driver, 10000)) {
+                if (listen_for_boot_signal(driver, 10000, 0)) {
                     magic_recieved = true;
                     break;
                 }
@@ -145,34 +188,39 @@ void bootloader_main(void) {
             }
         } else {
             // normal boot sequence
-            LED_OFF;
-            magic_recieved = listen_for_boot_signal(driver, BOOT_TIMEOUT_MS);
+            led_off();
+            // the application asked for an update, the programmer gets
+            // the whole window even if the host is slow to start sending
+            // nobody asked for one otherwise, so don't wait on an empty
+            // channel, the programmer repeats BOOT until it hears RDY
+            if (requested) {
+                magic_recieved = listen_for_boot_signal(driver, BOOT_TIMEOUT_MS, 0);
+            } else {
+                magic_recieved = listen_for_boot_signal(driver, BOOT_FALLBACK_MS, BOOT_QUIET_MS);
+            }
 
             if (!magic_recieved) {
-                LED_OFF;
                 jump_to_application();
                 return;
             }
         }
 
         if (magic_recieved) {
+            // the programmer is around, after a failed attempt
+            // give it the whole window to try again
+            requested = true;
+
             // blink lights to acknowledge BOOT received
-            for (int i = 0; i < 5; i++) {
-                LED_ON;
-                delay(50);
-                LED_OFF;
-                delay(50);
-            }
+            // in the background, RDY goes out right away
+            led_play(LED_READY);
 
             // return "ready" acknowledgment
-            const char* ack = "RDY";
-            driver.send((const uint8_t*)ack, 3);
-            driver.wait_packet_send();
+            send_ready(driver);
 
             // enter programming mode
             bool success = program_flash(driver);
             
-            LED_OFF;
+            led_off();
 
             if (success) {
                 // programming successful, jump to application